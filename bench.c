@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "buddy_os.h"
+
+/*
+ * Allocator benchmarks.
+ *
+ * workloads    standard workloads on a 128 MiB pool, reporting ops/sec
+ *              from an untimed pass and p50/p99/p999 ns/op from a pass
+ *              that times every call:
+ *                seq       fill with rank-1 pages, then drain in order
+ *                mixed     random alloc/return of ranks 1-8, mostly small
+ *                phase8b   see below
+ *                prodcons  producer allocates rank 1-4 buffers into a
+ *                          FIFO, consumer returns them after a random lag
+ * coalescing   eager vs. lazy coalescing under the Phase 8B pattern of
+ *              main.c (fill with rank-1 pages, return every even page,
+ *              then every odd page) and under alloc(1)/return ping-pong
+ * init         pool start-up time for 32K, 1M and 16M page pools; the
+ *              larger arenas are reserved, never touched beyond what
+ *              init writes
+ * placement    LIFO vs. address-ordered placement: mixed throughput, then
+ *              how far live blocks spread and what free space is left
+ *              for large ranks after a long random churn that keeps
+ *              half the pool live
+ * backing      random page touches through rank-10 blocks of a pool on
+ *              malloc memory vs. one from buddy_os_pool_create(), which
+ *              asks for huge pages
+ *
+ * usage: bench [workloads|coalescing|init|placement|backing|all] [rounds]
+ */
+
+#define TESTSIZE (128)
+#define PAGES ((int)(TESTSIZE * 1024L * 1024 / BUDDY_PAGE_SIZE))
+
+static void *arena;
+static void *meta;
+static void *pages[PAGES];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void setup(buddy_pool_t *pool, int lazy_limit) {
+    if (buddy_pool_init_meta(pool, arena, PAGES, meta) != OK ||
+        buddy_pool_set_lazy(pool, lazy_limit) != OK) {
+        printf("pool init failed\n");
+        exit(-1);
+    }
+}
+
+/*
+ * Workload runner. Every allocator call goes through op_alloc()/op_return()
+ * so the same workload code serves the throughput pass and the timed pass.
+ */
+struct run {
+    buddy_pool_t *pool;
+    int timed;
+    long nops;
+    long cap;
+    unsigned int *lat;  // ns per call, timed pass only
+    long overhead;      // cost of an empty timed section
+};
+
+static void record(struct run *run, long start) {
+    long ns = now_ns() - start - run->overhead;
+    if (run->nops < run->cap) {
+        run->lat[run->nops] = ns < 0 ? 0 : (unsigned int)ns;
+    }
+    run->nops++;
+}
+
+static void *op_alloc(struct run *run, int rank) {
+    if (!run->timed) {
+        run->nops++;
+        return buddy_pool_alloc(run->pool, rank);
+    }
+    long start = now_ns();
+    void *p = buddy_pool_alloc(run->pool, rank);
+    record(run, start);
+    return p;
+}
+
+static void op_return(struct run *run, void *p) {
+    if (!run->timed) {
+        run->nops++;
+        buddy_pool_return(run->pool, p);
+        return;
+    }
+    long start = now_ns();
+    buddy_pool_return(run->pool, p);
+    record(run, start);
+}
+
+static void wl_seq(struct run *run) {
+    int n = 0;
+    void *p;
+    while (!IS_ERR(p = op_alloc(run, 1))) {
+        pages[n++] = p;
+    }
+    for (int i = 0; i < n; i++) {
+        op_return(run, pages[i]);
+    }
+}
+
+static void wl_mixed(struct run *run) {
+    unsigned long rng = 12345;
+    int nlive = 0;
+    for (int op = 0; op < 2 * PAGES; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive < PAGES && (nlive == 0 || (r & 3) != 0)) {
+            int rank = (r >> 8) % 8 == 0 ? 1 + (int)((r >> 16) % 8)
+                                         : 1 + (int)((r >> 16) % 2);
+            void *p = op_alloc(run, rank);
+            if (!IS_ERR(p)) {
+                pages[nlive++] = p;
+            }
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            op_return(run, pages[i]);
+            pages[i] = pages[--nlive];
+        }
+    }
+    while (nlive > 0) {
+        op_return(run, pages[--nlive]);
+    }
+}
+
+static void wl_phase8b(struct run *run) {
+    for (int i = 0; i < PAGES; i++) {
+        pages[i] = op_alloc(run, 1);
+    }
+    for (int i = 0; i < PAGES; i += 2) {
+        op_return(run, pages[i]);
+    }
+    for (int i = 1; i < PAGES; i += 2) {
+        op_return(run, pages[i]);
+    }
+}
+
+static void wl_prodcons(struct run *run) {
+    // pages[] is a ring: producer pushes at tail, consumer pops at head
+    unsigned long rng = 67890;
+    long head = 0, tail = 0;
+    for (int op = 0; op < PAGES; op++) {
+        unsigned long r = xorshift(&rng);
+        void *p = op_alloc(run, 1 + (int)(r % 4));
+        if (!IS_ERR(p)) {
+            pages[tail++ % PAGES] = p;
+        } else if (head < tail) {
+            op_return(run, pages[head++ % PAGES]);  // Pool full: consume now
+        }
+        // Consumer lags by up to 1024 buffers
+        long lag = 1 + (long)((r >> 8) % 1024);
+        while (tail - head > lag) {
+            op_return(run, pages[head++ % PAGES]);
+        }
+    }
+    while (head < tail) {
+        op_return(run, pages[head++ % PAGES]);
+    }
+}
+
+static int cmp_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_workloads(int rounds) {
+    const char *name[] = {"seq", "mixed", "phase8b", "prodcons"};
+    void (*workload[])(struct run *) = {wl_seq, wl_mixed, wl_phase8b, wl_prodcons};
+    buddy_pool_t pool;
+    struct run run = {&pool, 0, 0, 0, NULL, 0};
+
+    // Calibrate the cost of the timer itself
+    long overhead = -1;
+    for (int i = 0; i < 1000; i++) {
+        long start = now_ns();
+        long ns = now_ns() - start;
+        if (overhead < 0 || ns < overhead) {
+            overhead = ns;
+        }
+    }
+
+    printf("workloads (%d rounds, timer overhead %ld ns subtracted):\n", rounds,
+           overhead);
+    printf("  %-9s %10s %8s %8s %8s\n", "workload", "Mops/s", "p50", "p99", "p999");
+    for (int w = 0; w < 4; w++) {
+        // Throughput pass
+        setup(&pool, 0);
+        run.timed = 0;
+        run.nops = 0;
+        double start = now();
+        for (int r = 0; r < rounds; r++) {
+            workload[w](&run);
+        }
+        double elapsed = now() - start;
+        long ops = run.nops;
+
+        // Latency pass, sized from the throughput pass
+        setup(&pool, 0);
+        run.timed = 1;
+        run.nops = 0;
+        run.cap = ops;
+        run.lat = malloc(ops * sizeof(*run.lat));
+        run.overhead = overhead;
+        if (run.lat == NULL) {
+            printf("out of memory\n");
+            exit(-1);
+        }
+        for (int r = 0; r < rounds; r++) {
+            workload[w](&run);
+        }
+        long n = run.nops < run.cap ? run.nops : run.cap;
+        qsort(run.lat, n, sizeof(*run.lat), cmp_uint);
+        printf("  %-9s %10.2f %6uns %6uns %6uns\n", name[w], ops / elapsed / 1e6,
+               run.lat[n / 2], run.lat[n * 99 / 100], run.lat[n * 999 / 1000]);
+        free(run.lat);
+        run.lat = NULL;
+    }
+    printf("  metadata: %lu bytes (pool %lu + page_rank %lu)\n",
+           (unsigned long)sizeof(buddy_pool_t) + buddy_meta_size(PAGES),
+           (unsigned long)sizeof(buddy_pool_t), buddy_meta_size(PAGES));
+}
+
+// Phase 8B of main.c: alloc every page, return the even ones, then the odd
+static long phase8b(buddy_pool_t *pool) {
+    for (int i = 0; i < PAGES; i++) {
+        pages[i] = buddy_pool_alloc(pool, 1);
+    }
+    for (int i = 0; i < PAGES; i += 2) {
+        buddy_pool_return(pool, pages[i]);
+    }
+    for (int i = 1; i < PAGES; i += 2) {
+        buddy_pool_return(pool, pages[i]);
+    }
+    return 2L * PAGES;
+}
+
+// Single-page alloc/return pairs on an empty pool; eager mode splits and
+// re-merges a whole MAXRANK block for every pair
+static long ping_pong(buddy_pool_t *pool) {
+    const int pairs = PAGES;
+    for (int i = 0; i < pairs; i++) {
+        void *p = buddy_pool_alloc(pool, 1);
+        buddy_pool_return(pool, p);
+    }
+    return 2L * pairs;
+}
+
+static void bench_coalescing(int rounds) {
+    static const int limits[] = {0, 16, 256, 4096};
+    const char *name[] = {"phase8b", "pingpong"};
+    long (*workload[])(buddy_pool_t *) = {phase8b, ping_pong};
+    buddy_pool_t pool;
+
+    printf("coalescing (%d rounds):\n", rounds);
+    for (int w = 0; w < 2; w++) {
+        for (unsigned l = 0; l < sizeof(limits) / sizeof(limits[0]); l++) {
+            setup(&pool, limits[l]);
+            long ops = 0;
+            double start = now();
+            for (int r = 0; r < rounds; r++) {
+                ops += workload[w](&pool);
+            }
+            double elapsed = now() - start;
+            if (limits[l] == 0) {
+                printf("  %-9s eager       %8.2f Mops/s\n", name[w], ops / elapsed / 1e6);
+            } else {
+                printf("  %-9s lazy/%-6d %8.2f Mops/s\n", name[w], limits[l],
+                       ops / elapsed / 1e6);
+            }
+        }
+    }
+}
+
+static void bench_placement(int rounds) {
+    static const char *name[] = {"lifo", "address"};
+    static const int flags[] = {0, BUDDY_POOL_ADDRESS_ORDERED};
+    buddy_pool_t pool;
+
+    printf("placement (%d rounds of mixed, then churn at half live):\n", rounds);
+    printf("  %-8s %10s %12s %8s %10s %10s\n", "policy", "Mops/s", "live span",
+           "largest", "unusable8", "unusable16");
+    for (int f = 0; f < 2; f++) {
+        if (buddy_pool_init_ex(&pool, arena, PAGES, meta, flags[f]) != OK) {
+            printf("pool init failed\n");
+            exit(-1);
+        }
+        struct run run = {&pool, 0, 0, 0, NULL, 0};
+        double start = now();
+        for (int r = 0; r < rounds; r++) {
+            wl_mixed(&run);
+        }
+        double elapsed = now() - start;
+
+        // Fill half the pool, then replace random live blocks with new
+        // ones of random rank at that level
+        unsigned long rng = 424242;
+        int nlive = 0;
+        long live_pages = 0;
+        for (long op = 0; op < 4L * PAGES; op++) {
+            unsigned long r = xorshift(&rng);
+            if (live_pages >= PAGES / 2) {
+                int i = (int)((r >> 24) % nlive);
+                live_pages -= 1L << (buddy_pool_query_ranks(&pool, pages[i]) - 1);
+                buddy_pool_return(&pool, pages[i]);
+                pages[i] = pages[--nlive];
+            }
+            int rank = (r >> 8) % 8 == 0 ? 1 + (int)((r >> 16) % 8)
+                                         : 1 + (int)((r >> 16) % 2);
+            void *p = buddy_pool_alloc(&pool, rank);
+            if (!IS_ERR(p)) {
+                pages[nlive++] = p;
+                live_pages += 1L << (rank - 1);
+            }
+        }
+        long span = 0;
+        for (int i = 0; i < nlive; i++) {
+            long end = ((char *)pages[i] - (char *)arena) / (long)BUDDY_PAGE_SIZE +
+                       (1L << (buddy_pool_query_ranks(&pool, pages[i]) - 1));
+            if (end > span) {
+                span = end;
+            }
+        }
+
+        struct buddy_free_info info;
+        buddy_pool_query_free(&pool, &info);
+        printf("  %-8s %10.2f %11ld%% %8d %10d %10d\n", name[f],
+               run.nops / elapsed / 1e6, span * 100 / PAGES,
+               info.largest_free_rank, buddy_unusable_index(&info, 8),
+               buddy_unusable_index(&info, BUDDY_MAXRANK));
+        while (nlive > 0) {
+            buddy_pool_return(&pool, pages[--nlive]);
+        }
+    }
+}
+
+// Rank of the blocks touch_blocks() goes through: 2 MiB of 4 KiB pages
+#define TOUCH_RANK (BUDDY_MAXRANK < 10 ? BUDDY_MAXRANK : 10)
+#define TOUCH_PAGES (1 << (TOUCH_RANK - 1))
+
+// Touch one word of a random page in random TOUCH_RANK blocks of the pool
+static double touch_blocks(buddy_pool_t *pool, int rounds) {
+    int nblocks = 0;
+    void *p;
+    while (!IS_ERR(p = buddy_pool_alloc(pool, TOUCH_RANK))) {
+        pages[nblocks++] = p;
+    }
+    for (int i = 0; i < nblocks; i++) {
+        // Fault everything in first
+        memset(pages[i], 0, TOUCH_PAGES * BUDDY_PAGE_SIZE);
+    }
+
+    unsigned long rng = 777;
+    long touches = (long)rounds * PAGES;
+    unsigned long sum = 0;
+    double start = now();
+    for (long t = 0; t < touches; t++) {
+        unsigned long r = xorshift(&rng);
+        volatile unsigned long *word =
+            (unsigned long *)((char *)pages[r % nblocks] +
+                              ((r >> 32) % TOUCH_PAGES) * BUDDY_PAGE_SIZE);
+        sum += (*word)++;
+    }
+    double elapsed = now() - start;
+    (void)sum;
+
+    for (int i = 0; i < nblocks; i++) {
+        buddy_pool_return(pool, pages[i]);
+    }
+    return elapsed / touches * 1e9;
+}
+
+static void bench_backing(int rounds) {
+    static const char *backing_name[] = {"small pages", "THP advised", "hugetlb"};
+    buddy_pool_t pool;
+
+    printf("backing (%d rounds of random page touches):\n", rounds);
+    setup(&pool, 0);
+    printf("  %-24s %8.2f ns/touch\n", "malloc arena", touch_blocks(&pool, rounds));
+
+    int backing;
+    if (buddy_os_pool_create(&pool, PAGES, 0, &backing) != OK) {
+        printf("  buddy_os_pool_create failed\n");
+        return;
+    }
+    char label[32];
+    snprintf(label, sizeof(label), "os arena, %s", backing_name[backing]);
+    printf("  %-24s %8.2f ns/touch\n", label, touch_blocks(&pool, rounds));
+    buddy_os_pool_destroy(&pool);
+}
+
+static void bench_init(int rounds) {
+    static const long sizes[] = {32L * 1024, 1024L * 1024, 16L * 1024 * 1024};
+    buddy_pool_t pool;
+
+    printf("init (%d rounds):\n", rounds);
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int pgcount = (int)sizes[i];
+        void *region = mmap(NULL, sizes[i] * BUDDY_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        void *region_meta = malloc(buddy_meta_size(pgcount));
+        if (region == MAP_FAILED || region_meta == NULL) {
+            printf("  %9d pages: cannot reserve arena, skipped\n", pgcount);
+            free(region_meta);
+            continue;
+        }
+
+        // The first init faults in the metadata and the seeded block heads
+        buddy_pool_init_meta(&pool, region, pgcount, region_meta);
+        double start = now();
+        for (int r = 0; r < rounds; r++) {
+            buddy_pool_init_meta(&pool, region, pgcount, region_meta);
+        }
+        double elapsed = now() - start;
+        printf("  %9d pages: %10.1f us/init\n", pgcount, elapsed / rounds * 1e6);
+
+        munmap(region, sizes[i] * BUDDY_PAGE_SIZE);
+        free(region_meta);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *section = argc > 1 ? argv[1] : "all";
+    int rounds = argc > 2 ? atoi(argv[2]) : 20;
+    int all = strcmp(section, "all") == 0;
+    if (rounds < 1 || (!all && strcmp(section, "workloads") != 0 &&
+                       strcmp(section, "coalescing") != 0 &&
+                       strcmp(section, "init") != 0 &&
+                       strcmp(section, "placement") != 0 &&
+                       strcmp(section, "backing") != 0)) {
+        printf("usage: %s [workloads|coalescing|init|placement|backing|all] "
+               "[rounds]\n", argv[0]);
+        return -1;
+    }
+
+    arena = aligned_alloc(BUDDY_PAGE_SIZE, TESTSIZE * 1024L * 1024);
+    meta = malloc(buddy_meta_size_ex(PAGES, BUDDY_POOL_ADDRESS_ORDERED));
+    if (arena == NULL || meta == NULL) {
+        printf("out of memory\n");
+        return -1;
+    }
+
+    if (all || strcmp(section, "workloads") == 0) {
+        bench_workloads(rounds);
+    }
+    if (all || strcmp(section, "coalescing") == 0) {
+        bench_coalescing(rounds);
+    }
+    if (all || strcmp(section, "init") == 0) {
+        bench_init(rounds);
+    }
+    if (all || strcmp(section, "placement") == 0) {
+        bench_placement(rounds);
+    }
+    if (all || strcmp(section, "backing") == 0) {
+        bench_backing(rounds);
+    }
+    return 0;
+}
@@ -1,33 +1,329 @@
 #include "buddy.h"
+#if defined(__unix__)
+#include <sched.h>
+#endif
+#ifndef NULL
 #define NULL ((void *)0)
+#endif
 
-#define MAXRANK 16
-#define PAGE_SIZE 4096
+// Allocator tracing (see trace.h), compiled in only with -DBUDDY_TRACE
+#ifdef BUDDY_TRACE
+#include "trace.h"
+#define TRACE(pool, op, rank, page_idx) buddy_trace_event(pool, op, rank, page_idx, 0)
+#define TRACE_EXACT(pool, op, page_idx, npages) \
+    buddy_trace_event(pool, op, 0, page_idx, npages)
+#else
+#define TRACE(pool, op, rank, page_idx) ((void)0)
+#define TRACE_EXACT(pool, op, page_idx, npages) ((void)0)
+#endif
+
+#define MAXRANK BUDDY_MAXRANK
+#define PAGE_SHIFT BUDDY_PAGE_SHIFT
+#define PAGE_SIZE (1L << PAGE_SHIFT)
 #define ALLOCATED_BIT 0x80  // High bit indicates allocated
+#define EXACT_BIT 0x40      // Allocated piece of an alloc_pages_exact() range
+#define TAIL_BIT 0x20       // Exact piece other than the first of its range
+#define COLD_BIT 0x40       // Free block whose memory was decommitted
+#define CACHED_BIT 0x20     // Allocated block in a pcp or a deferred queue
+#define RANK_MASK 0x1F
+#define PAGEBLOCK_MASK BUDDY_POOL_PAGEBLOCK(RANK_MASK)
+
+// Ranks must fit RANK_MASK and free_mask, and free pages must hold their
+// list links
+_Static_assert(MAXRANK >= 1 && MAXRANK <= RANK_MASK, "BUDDY_MAXRANK out of range");
+_Static_assert(PAGE_SHIFT >= 4 && PAGE_SHIFT < 8 * sizeof(long) - MAXRANK,
+               "BUDDY_PAGE_SHIFT out of range");
 
-// Free list for each rank - doubly linked for O(1) removal
+// Free list for each rank - doubly linked for O(1) removal. Links are
+// page indices, -1 ends the list; they live in the free block itself or,
+// for BUDDY_POOL_OFFPAGE pools, in a side table indexed by page.
 typedef struct free_block {
-    struct free_block *next;
-    struct free_block *prev;
+    int next;
+    int prev;
 } free_block_t;
 
-static free_block_t *free_lists[MAXRANK + 1];
-static void *memory_start;
-static int total_pages;
-static unsigned char page_rank[65536]; // Track rank of each page
-                                       // bit 7: 1=allocated, 0=free
-                                       // bits 0-6: rank (1-16)
+// Instance behind the init_page()/alloc_pages() interface
+static buddy_pool_t default_pool;
+
+// Metadata used by init_page() for pools that fit, with the free bitmaps
+// of the address index: a level holds at most 1/63 of the blocks of the
+// level below plus one, so a rank needs at most 1/63 as many words as it
+// has pages plus one per level. Larger pools carve their metadata from
+// the end of the managed range instead.
+#define DEFAULT_META_PAGES 65536
+#define DEFAULT_FLAGS BUDDY_POOL_ADDRESS_INDEX
+static unsigned long default_meta[DEFAULT_META_PAGES / sizeof(unsigned long) + 1 +
+                                  2 * DEFAULT_META_PAGES / 63 +
+                                  MAXRANK * BUDDY_BITMAP_LEVELS];
+
+#define SPIN_LIMIT 64  // Busy-wait iterations before yielding the CPU
+
+// Pages of a zone buddy_pool_compact() sizes up per call, at least one region
+#define COMPACT_SCAN_PAGES 65536
+
+// Helpers to resolve the offsets a pool keeps instead of pointers (see
+// buddy_pool_t). The sums are done on integers so that the compiler does
+// not take the results to point into the pool structure.
+static inline void *pool_at(const buddy_pool_t *pool, long offset) {
+    return (void *)((unsigned long)pool + offset);
+}
+
+static inline long pool_offset(const buddy_pool_t *pool, const void *p) {
+    return (long)((unsigned long)p - (unsigned long)pool);
+}
+
+static inline char *pool_memory(buddy_pool_t *pool) {
+    return pool_at(pool, pool->memory_start);
+}
+
+static inline unsigned char *page_ranks(buddy_pool_t *pool) {
+    return pool_at(pool, pool->page_rank);
+}
+
+static inline unsigned char *block_classes(buddy_pool_t *pool) {
+    return pool_at(pool, pool->block_class);
+}
+
+static inline unsigned char *page_classes(buddy_pool_t *pool) {
+    return pool_at(pool, pool->page_class);
+}
+
+static inline unsigned long *bitmap_words(buddy_pool_t *pool) {
+    return pool_at(pool, pool->free_bitmap_words);
+}
+
+// Helper function to tell whether pools with flags keep the free bitmaps:
+// address-ordered pools place blocks by them, any pool with the address
+// index finds blocks in a range by them
+static inline int has_bitmaps(int flags) {
+    return (flags & (BUDDY_POOL_ADDRESS_ORDERED | BUDDY_POOL_ADDRESS_INDEX)) != 0;
+}
+
+// Helpers to access page_rank. In thread-safe mode an entry is only
+// changed by the owner of its block, or under the lock of the rank the
+// block is free at, so relaxed accesses are all that is needed to keep
+// concurrent readers well defined.
+static inline int get_rank_byte(buddy_pool_t *pool, int page_idx) {
+    return __atomic_load_n(&page_ranks(pool)[page_idx], __ATOMIC_RELAXED);
+}
+
+static inline void set_rank_byte(buddy_pool_t *pool, int page_idx, int value) {
+    __atomic_store_n(&page_ranks(pool)[page_idx], (unsigned char)value,
+                     __ATOMIC_RELAXED);
+}
+
+// Helpers to take one of the pool's spinlocks, such as a rank's; no-ops
+// unless the pool is thread-safe
+static inline void lock_word(buddy_pool_t *pool, int *lock) {
+    if (!(pool->flags & BUDDY_POOL_THREADSAFE)) {
+        return;
+    }
+    int spins = 0;
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            if (++spins < SPIN_LIMIT) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            } else {
+#if defined(__unix__)
+                sched_yield();
+#endif
+                spins = 0;
+            }
+        }
+    }
+}
+
+static inline void unlock_word(buddy_pool_t *pool, int *lock) {
+    if (pool->flags & BUDDY_POOL_THREADSAFE) {
+        __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void lock_rank(buddy_pool_t *pool, int rank) {
+    lock_word(pool, &pool->area[rank].lock);
+}
+
+static inline void unlock_rank(buddy_pool_t *pool, int rank) {
+    unlock_word(pool, &pool->area[rank].lock);
+}
+
+// Helpers to keep a mask such as free_mask and the per-rank counts in
+// step with the free lists. Counts change under the rank lock; a mask is
+// shared by all ranks, so thread-safe pools update it atomically.
+static inline void count_free_block(buddy_pool_t *pool, struct buddy_free_area *area,
+                                    unsigned int *mask, int rank, int delta) {
+    int count = area->count + delta;
+    __atomic_store_n(&area->count, count, __ATOMIC_RELAXED);
+    if (count == 0) {
+        if (pool->flags & BUDDY_POOL_THREADSAFE) {
+            __atomic_fetch_and(mask, ~(1u << rank), __ATOMIC_RELAXED);
+        } else {
+            *mask &= ~(1u << rank);
+        }
+    } else if (count == 1 && delta > 0) {
+        if (pool->flags & BUDDY_POOL_THREADSAFE) {
+            __atomic_fetch_or(mask, 1u << rank, __ATOMIC_RELAXED);
+        } else {
+            *mask |= 1u << rank;
+        }
+    }
+}
+
+// Helper function to get the free list a block of rank at page_idx
+// belongs on: below the pageblock rank of a grouped pool that is its
+// pageblock's class list, and *cls is set to the class; otherwise it is
+// the shared list of the rank and *cls is -1. Classes only change with
+// every rank below the pageblock rank locked.
+static inline struct buddy_free_area *free_area(buddy_pool_t *pool, int page_idx,
+                                                int rank, int *cls) {
+    if (rank >= pool->pageblock_rank) {
+        *cls = -1;
+        return &pool->area[rank];
+    }
+    *cls = __atomic_load_n(&block_classes(pool)[page_idx >> (pool->pageblock_rank - 1)],
+                           __ATOMIC_RELAXED);
+    return &pool->class_area[*cls][rank];
+}
+
+// Helper function to count a block onto (delta 1) or off (delta -1) the
+// free list area: area[rank] keeps the totals of all the rank's lists,
+// which free_mask and the queries go by, and a class list keeps its own
+static inline void count_listed(buddy_pool_t *pool, struct buddy_free_area *area,
+                                int cls, int rank, int delta, int cold) {
+    count_free_block(pool, &pool->area[rank], &pool->free_mask, rank, delta);
+    if (cold) {
+        __atomic_store_n(&pool->area[rank].cold_count,
+                         pool->area[rank].cold_count + delta, __ATOMIC_RELAXED);
+    }
+    if (cls >= 0) {
+        count_free_block(pool, area, &pool->class_mask[cls], rank, delta);
+        if (cold) {
+            __atomic_store_n(&area->cold_count, area->cold_count + delta,
+                             __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Helper function to collect the free lists of rank into lists: the
+// shared one and, below the pageblock rank, one per class. Returns how
+// many there are.
+static int rank_lists(buddy_pool_t *pool, int rank, struct buddy_free_area **lists) {
+    int n = 0;
+    lists[n++] = &pool->area[rank];
+    for (int c = 0; rank < pool->pageblock_rank && c < BUDDY_CLASSES; c++) {
+        lists[n++] = &pool->class_area[c][rank];
+    }
+    return n;
+}
+
+// Statistics: each thread adds to its own slot, readers sum the slots.
+// Thread-safe pools can have more threads than slots, so they add
+// atomically; that is still an uncontended cache line in the common case.
+static int next_stat_slot;
+static _Thread_local int thread_stat_slot = -1;
+
+static inline struct buddy_stat_slot *stat_slot(buddy_pool_t *pool) {
+    if (!(pool->flags & BUDDY_POOL_THREADSAFE)) {
+        return &pool->stats[0];
+    }
+    if (thread_stat_slot < 0) {
+        thread_stat_slot = __atomic_fetch_add(&next_stat_slot, 1, __ATOMIC_RELAXED) %
+                           BUDDY_STAT_SLOTS;
+    }
+    return &pool->stats[thread_stat_slot];
+}
+
+#define STAT_ADD(pool, field, n)                                              \
+    do {                                                                      \
+        if ((pool)->flags & BUDDY_POOL_STATS) {                               \
+            unsigned long *counter_ = &stat_slot(pool)->field;                \
+            if ((pool)->flags & BUDDY_POOL_THREADSAFE) {                      \
+                __atomic_fetch_add(counter_, (n), __ATOMIC_RELAXED);          \
+            } else {                                                          \
+                *counter_ += (n);                                             \
+            }                                                                 \
+        }                                                                     \
+    } while (0)
+
+// Helper function to get the address of a page
+static void *page_addr(buddy_pool_t *pool, int page_idx) {
+    return pool_memory(pool) + ((long)page_idx << PAGE_SHIFT);
+}
 
 // Helper function to get page index
-static int get_page_index(void *p) {
-    if (p < memory_start || p >= memory_start + total_pages * PAGE_SIZE) {
+static int get_page_index(buddy_pool_t *pool, void *p) {
+    char *start = pool_memory(pool);
+    if ((char *)p < start || (char *)p >= start + (long)pool->total_pages * PAGE_SIZE) {
         return -1;
     }
-    long offset = (char *)p - (char *)memory_start;
-    if (offset % PAGE_SIZE != 0) {
+    unsigned long offset = (char *)p - start;
+    if (offset & (PAGE_SIZE - 1)) {
         return -1;
     }
-    return offset / PAGE_SIZE;
+    return offset >> PAGE_SHIFT;
+}
+
+// Zones of a pool that grew with buddy_pool_add_region(): every region
+// is a pool of its own, and the pool's table lists them all, itself
+// included, sorted by address. A table is replaced, never changed, when
+// a region is added, so readers only need to load the pointer.
+struct buddy_zone_table {
+    int nzones;
+    buddy_pool_t *zone[];
+};
+
+static inline struct buddy_zone_table *zone_table(buddy_pool_t *pool) {
+    return __atomic_load_n(&pool->zones, __ATOMIC_ACQUIRE);
+}
+
+// Iterate over the regions added to pool, not counting pool itself
+#define for_each_region(pool, zone)                                           \
+    for (struct buddy_zone_table *zt_ = zone_table(pool); zt_ != NULL;        \
+         zt_ = NULL)                                                          \
+        for (int zi_ = 0; zi_ < zt_->nzones; zi_++)                           \
+            if (((zone) = zt_->zone[zi_]) != (pool))
+
+// Helper function to find the zone that owns p; pool itself if none does
+static buddy_pool_t *zone_of(buddy_pool_t *pool, void *p) {
+    struct buddy_zone_table *table = zone_table(pool);
+    if (table == NULL || get_page_index(pool, p) >= 0) {
+        return pool;
+    }
+
+    // Last zone starting at or below p
+    int lo = 0, hi = table->nzones - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (pool_memory(table->zone[mid]) <= (char *)p) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return get_page_index(table->zone[lo], p) >= 0 ? table->zone[lo] : pool;
+}
+
+// Helper function to get the list links of the free block at page_idx
+static inline free_block_t *block_links(buddy_pool_t *pool, int page_idx) {
+    if (pool->free_links != 0) {
+        return (free_block_t *)pool_at(pool, pool->free_links) + page_idx;
+    }
+    return (free_block_t *)page_addr(pool, page_idx);
+}
+
+// Helper function to find the head page of the block containing page_idx.
+// Blocks are aligned to their size and only heads are marked, so the head
+// is the first marked page found by aligning page_idx down rank by rank.
+static int find_block_head(buddy_pool_t *pool, int page_idx) {
+    for (int r = 1; r <= MAXRANK; r++) {
+        int head = page_idx & ~((1 << (r - 1)) - 1);
+        if (get_rank_byte(pool, head) != 0) {
+            return head;
+        }
+    }
+    return -1;
 }
 
 // Helper function to get buddy index
@@ -36,214 +332,2578 @@ static int get_buddy_index(int page_idx, int rank) {
     return page_idx ^ pages_in_block;
 }
 
-// Helper function to check if a block is in free list
-static int is_block_in_free_list(int page_idx, int rank) {
-    void *block_addr = memory_start + page_idx * PAGE_SIZE;
-    free_block_t *current = free_lists[rank];
-    while (current != NULL) {
-        if ((void *)current == block_addr) {
-            return 1;
+// Helper function to claim the block at page_idx for freeing: its mark
+// goes from rank_byte to value. Hardened pools swap it atomically, so of
+// two threads freeing the same block only one gets it.
+static inline int claim_block(buddy_pool_t *pool, int page_idx, int rank_byte,
+                              int value) {
+    if (!(pool->flags & BUDDY_POOL_HARDENED)) {
+        set_rank_byte(pool, page_idx, value);
+        return 1;
+    }
+    unsigned char expected = rank_byte;
+    return __atomic_compare_exchange_n(&page_ranks(pool)[page_idx], &expected,
+                                       (unsigned char)value, 0, __ATOMIC_RELAXED,
+                                       __ATOMIC_RELAXED);
+}
+
+// Helper function to record the class of the block allocated at page_idx
+// in a grouped pool, for steal_pageblock() to weigh; allocations that
+// take no class are unmovable
+static inline void set_page_class(buddy_pool_t *pool, int page_idx, int cls) {
+    if (pool->page_class != 0) {
+        __atomic_store_n(&page_classes(pool)[page_idx], (unsigned char)cls,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+// Helpers for the free bitmaps of address-ordered pools. A bit is set in
+// every level whose word below it is non-zero, so the lowest set bit is
+// found by following the lowest set bits down from the one-word top.
+// Levels are given by their first word in words, -1 past the top.
+static void bitmap_set(unsigned long *words, const int *level, int bit) {
+    for (int l = 0; l < BUDDY_BITMAP_LEVELS && level[l] >= 0; l++) {
+        unsigned long *word = &words[level[l] + (bit >> 6)];
+        int was_empty = *word == 0;
+        *word |= 1UL << (bit & 63);
+        if (!was_empty) {
+            break;
         }
-        current = current->next;
+        bit >>= 6;
+    }
+}
+
+static void bitmap_clear(unsigned long *words, const int *level, int bit) {
+    for (int l = 0; l < BUDDY_BITMAP_LEVELS && level[l] >= 0; l++) {
+        unsigned long *word = &words[level[l] + (bit >> 6)];
+        *word &= ~(1UL << (bit & 63));
+        if (*word != 0) {
+            break;
+        }
+        bit >>= 6;
     }
-    return 0;
 }
 
-// Helper function to remove a block from free list
-static void remove_from_free_list(int page_idx, int rank) {
-    void *block_addr = memory_start + page_idx * PAGE_SIZE;
-    free_block_t *block = (free_block_t *)block_addr;
+static int bitmap_first(unsigned long *words, const int *level) {
+    int l = 0;
+    while (l + 1 < BUDDY_BITMAP_LEVELS && level[l + 1] >= 0) {
+        l++;
+    }
+    int bit = 0;
+    for (; l >= 0; l--) {
+        unsigned long word = words[level[l] + bit];
+        if (word == 0) {
+            return -1;
+        }
+        bit = bit * 64 + __builtin_ctzl(word);
+    }
+    return bit;
+}
+
+// First set bit at or after bit in a bitmap of nbits bits, or -1: climb
+// while the rest of the word is empty, then descend by lowest set bits
+static int bitmap_next(unsigned long *words, const int *level, int nbits, int bit) {
+    int l = 0;
+    for (;;) {
+        if (bit >= nbits) {
+            return -1;
+        }
+        unsigned long word = words[level[l] + (bit >> 6)] & (~0UL << (bit & 63));
+        if (word != 0) {
+            bit = (bit & ~63) + __builtin_ctzl(word);
+            break;
+        }
+        if (l + 1 == BUDDY_BITMAP_LEVELS || level[l + 1] < 0) {
+            return -1;
+        }
+        bit = (bit >> 6) + 1;
+        nbits = (nbits + 63) / 64;
+        l++;
+    }
+    for (; l > 0; l--) {
+        bit = bit * 64 + __builtin_ctzl(words[level[l - 1] + bit]);
+    }
+    return bit;
+}
+
+// Helper function to tell whether the block at page_idx is free at rank,
+// warm or cold
+static inline int is_free_block(buddy_pool_t *pool, int page_idx, int rank) {
+    return (get_rank_byte(pool, page_idx) & ~COLD_BIT) == rank;
+}
+
+// Helper function for hardened pools to check the list links around a
+// free block before they are followed or rewritten. With in-page links a
+// write after free shows up here as a neighbour that is not a free block
+// of the rank or does not point back; that is unrecoverable, so trap
+// rather than hand out memory twice.
+static void check_links(buddy_pool_t *pool, int page_idx, int rank) {
+    if (!(pool->flags & BUDDY_POOL_HARDENED)) {
+        return;
+    }
+    free_block_t *block = block_links(pool, page_idx);
+    int next = block->next, prev = block->prev;
+    if ((next >= 0 && (next >= pool->total_pages || !is_free_block(pool, next, rank) ||
+                       block_links(pool, next)->prev != page_idx)) ||
+        (prev >= 0 && (prev >= pool->total_pages || !is_free_block(pool, prev, rank) ||
+                       block_links(pool, prev)->next != page_idx)) ||
+        next < -1 || prev < -1) {
+        __builtin_trap();
+    }
+}
+
+// Helper function to remove a block from free list; its mark must still
+// be in place to tell which list it is on
+static void remove_from_free_list(buddy_pool_t *pool, int page_idx, int rank) {
+    free_block_t *block = block_links(pool, page_idx);
+    check_links(pool, page_idx, rank);
+    int cls;
+    struct buddy_free_area *area = free_area(pool, page_idx, rank, &cls);
+    int cold = (get_rank_byte(pool, page_idx) & COLD_BIT) != 0;
 
     // Remove from doubly-linked list
-    if (block->prev != NULL) {
-        block->prev->next = block->next;
+    if (block->prev >= 0) {
+        block_links(pool, block->prev)->next = block->next;
+    } else if (cold) {
+        area->cold_head = block->next;
     } else {
         // This is the head of the list
-        free_lists[rank] = block->next;
+        area->head = block->next;
+    }
+
+    if (block->next >= 0) {
+        block_links(pool, block->next)->prev = block->prev;
+    }
+    count_listed(pool, area, cls, rank, -1, cold);
+    if (has_bitmaps(pool->flags)) {
+        bitmap_clear(bitmap_words(pool), pool->free_bitmap[rank], page_idx >> (rank - 1));
     }
+}
 
-    if (block->next != NULL) {
-        block->next->prev = block->prev;
+// Helper function to add a cold block to its rank's cold list. Cold
+// blocks are never pending: they are only made by buddy_pool_reclaim()
+// after coalescing, or split off other cold blocks.
+static void add_to_cold_list(buddy_pool_t *pool, int page_idx, int rank) {
+    free_block_t *block = block_links(pool, page_idx);
+    int cls;
+    struct buddy_free_area *area = free_area(pool, page_idx, rank, &cls);
+    block->next = area->cold_head;
+    block->prev = -1;
+    if (block->next >= 0) {
+        block_links(pool, block->next)->prev = page_idx;
+    }
+    area->cold_head = page_idx;
+    count_listed(pool, area, cls, rank, 1, 1);
+    if (has_bitmaps(pool->flags)) {
+        bitmap_set(bitmap_words(pool), pool->free_bitmap[rank], page_idx >> (rank - 1));
     }
+    set_rank_byte(pool, page_idx, rank | COLD_BIT);
 }
 
 // Helper function to add block to free list
-static void add_to_free_list(int page_idx, int rank) {
-    void *block_addr = memory_start + page_idx * PAGE_SIZE;
-    free_block_t *block = (free_block_t *)block_addr;
+static void add_to_free_list(buddy_pool_t *pool, int page_idx, int rank) {
+    free_block_t *block = block_links(pool, page_idx);
+    int cls;
+    struct buddy_free_area *area = free_area(pool, page_idx, rank, &cls);
 
     // Add to head of doubly-linked list
-    block->next = free_lists[rank];
-    block->prev = NULL;
+    block->next = area->head;
+    block->prev = -1;
 
-    if (free_lists[rank] != NULL) {
-        free_lists[rank]->prev = block;
+    if (block->next >= 0) {
+        block_links(pool, block->next)->prev = page_idx;
+    }
+    area->head = page_idx;
+    count_listed(pool, area, cls, rank, 1, 0);
+    if (pool->lazy_limit > 0) {
+        // Read without the lock by coalesce_above()
+        __atomic_store_n(&area->pending, area->pending + 1, __ATOMIC_RELAXED);
+    }
+    if (has_bitmaps(pool->flags)) {
+        bitmap_set(bitmap_words(pool), pool->free_bitmap[rank], page_idx >> (rank - 1));
     }
-    free_lists[rank] = block;
 
     // Only mark the first page of the free block with the rank
     // This is sufficient for buddy merging check
-    page_rank[page_idx] = rank;  // Free block
+    set_rank_byte(pool, page_idx, rank);  // Free block
 }
 
-int init_page(void *p, int pgcount) {
-    memory_start = p;
-    total_pages = pgcount;
+// Helper function to lay out the free bitmaps of every rank in one array
+// of words, or only count the words when pool is NULL
+static unsigned long setup_bitmaps(buddy_pool_t *pool, int pgcount) {
+    unsigned long total = 0;
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        int nbits = pgcount >> (rank - 1);
+        for (int l = 0; l < BUDDY_BITMAP_LEVELS; l++) {
+            if (pool != NULL) {
+                pool->free_bitmap[rank][l] = nbits > 0 ? (int)total : -1;
+            }
+            if (nbits > 0) {
+                nbits = (nbits + 63) / 64;
+                total += nbits;
+                if (nbits == 1) {
+                    nbits = 0;  // This was the top level
+                }
+            }
+        }
+    }
+    return total;
+}
 
-    // Initialize page_rank array
-    for (int i = 0; i < pgcount; i++) {
-        page_rank[i] = 0;
+unsigned long buddy_meta_size_ex(int pgcount, int flags) {
+    if (pgcount < 0) {
+        return 0;
+    }
+    // One page_rank byte per page, then the optional tables, word aligned
+    unsigned long size = (unsigned long)pgcount;
+    if ((flags & (BUDDY_POOL_OFFPAGE | PAGEBLOCK_MASK)) || has_bitmaps(flags)) {
+        size += sizeof(unsigned long) - 1;
+    }
+    if (flags & BUDDY_POOL_OFFPAGE) {
+        size += (unsigned long)pgcount * sizeof(free_block_t);
+    }
+    if (has_bitmaps(flags)) {
+        size += setup_bitmaps(NULL, pgcount) * sizeof(unsigned long);
+    }
+    int pageblock_rank = (flags & PAGEBLOCK_MASK) / BUDDY_POOL_PAGEBLOCK(1);
+    if (pageblock_rank > 0) {
+        size += ((unsigned long)pgcount + (1 << (pageblock_rank - 1)) - 1) >>
+                (pageblock_rank - 1);
+        size += (unsigned long)pgcount;
+    }
+    return size;
+}
+
+unsigned long buddy_meta_size(int pgcount) {
+    return buddy_meta_size_ex(pgcount, 0);
+}
+
+// Helper function to tell whether flags are a valid BUDDY_POOL_* set
+static int valid_flags(int flags) {
+    int pageblock_rank = (flags & PAGEBLOCK_MASK) / BUDDY_POOL_PAGEBLOCK(1);
+    return (flags & ~(BUDDY_POOL_THREADSAFE | BUDDY_POOL_STATS |
+                      BUDDY_POOL_ADDRESS_ORDERED | BUDDY_POOL_OFFPAGE |
+                      BUDDY_POOL_HARDENED | BUDDY_POOL_DEFERRED |
+                      BUDDY_POOL_ADDRESS_INDEX | PAGEBLOCK_MASK)) == 0 &&
+           pageblock_rank != 1 && pageblock_rank <= MAXRANK &&
+           (pageblock_rank == 0 || !(flags & BUDDY_POOL_ADDRESS_ORDERED));
+}
+
+// Helper function to point the pool's metadata at meta: page_rank first,
+// then the side tables of flags, word aligned. Returns where the side
+// tables start.
+static char *setup_meta(buddy_pool_t *pool, int pgcount, void *meta, int flags) {
+    pool->page_rank = pool_offset(pool, meta);
+    char *start = (char *)(((unsigned long)meta + pgcount + sizeof(unsigned long) - 1) &
+                           ~(sizeof(unsigned long) - 1));
+    char *table = start;
+    pool->free_links = 0;
+    if (flags & BUDDY_POOL_OFFPAGE) {
+        pool->free_links = pool_offset(pool, table);
+        table += (unsigned long)pgcount * sizeof(free_block_t);
+    }
+    pool->free_bitmap_words = 0;
+    if (has_bitmaps(flags)) {
+        pool->free_bitmap_words = pool_offset(pool, table);
+        table += setup_bitmaps(pool, pgcount) * sizeof(unsigned long);
+    } else {
+        __builtin_memset(pool->free_bitmap, 0xff, sizeof(pool->free_bitmap));
+    }
+
+    int pageblock_rank = (flags & PAGEBLOCK_MASK) / BUDDY_POOL_PAGEBLOCK(1);
+    pool->pageblock_rank = pageblock_rank;
+    pool->block_class = 0;
+    pool->page_class = 0;
+    if (pageblock_rank > 0) {
+        pool->block_class = pool_offset(pool, table);
+        pool->page_class = pool->block_class +
+                           (((unsigned long)pgcount + (1 << (pageblock_rank - 1)) - 1) >>
+                            (pageblock_rank - 1));
+    }
+    return start;
+}
+
+int buddy_pool_init_ex(buddy_pool_t *pool, void *p, int pgcount, void *meta,
+                       int flags) {
+    if (pool == NULL || p == NULL || pgcount <= 0 || !valid_flags(flags)) {
+        return -EINVAL;
+    }
+
+    // Without a caller-provided region, carve the metadata from the
+    // last pages of the pool and manage only what precedes it
+    if (meta == NULL) {
+        int meta_pages = (buddy_meta_size_ex(pgcount, flags) + PAGE_SIZE - 1) /
+                         PAGE_SIZE;
+        if (meta_pages >= pgcount) {
+            return -EINVAL;
+        }
+        pgcount -= meta_pages;
+        meta = (char *)p + (long)pgcount * PAGE_SIZE;
+    }
+
+    pool->flags = flags;
+    pool->memory_start = pool_offset(pool, p);
+    pool->total_pages = pgcount;
+    setup_meta(pool, pgcount, meta, flags);
+
+    // Only block heads are ever non-zero, so clear the whole array at once.
+    // Links are written when a block is listed, so of the side tables
+    // only the bitmaps need clearing.
+    __builtin_memset(page_ranks(pool), 0, (unsigned long)pgcount);
+    if (has_bitmaps(flags)) {
+        __builtin_memset(bitmap_words(pool), 0,
+                         setup_bitmaps(NULL, pgcount) * sizeof(unsigned long));
+    }
+
+    // Grouped pools start with every pageblock movable, as Linux does
+    if (pool->pageblock_rank > 0) {
+        __builtin_memset(block_classes(pool), BUDDY_CLASS_MOVABLE,
+                         pool->page_class - pool->block_class);
+        __builtin_memset(page_classes(pool), BUDDY_CLASS_UNMOVABLE,
+                         (unsigned long)pgcount);
     }
 
     // Initialize free lists
     for (int i = 0; i <= MAXRANK; i++) {
-        free_lists[i] = NULL;
+        pool->area[i].head = -1;
+        pool->area[i].cold_head = -1;
+        pool->area[i].cold_count = 0;
+        pool->area[i].count = 0;
+        pool->area[i].lock = 0;
+        pool->area[i].pending = 0;
+    }
+    for (int c = 0; c < BUDDY_CLASSES; c++) {
+        for (int i = 0; i < MAXRANK; i++) {
+            pool->class_area[c][i] = pool->area[i];
+        }
+        pool->class_mask[c] = 0;
+    }
+    pool->lazy_limit = 0;
+    pool->free_mask = 0;
+    pool->zones = NULL;
+    pool->zone_lock = 0;
+    pool->compact_cursor = 0;
+    for (int i = 0; i < BUDDY_COMPACT_PINNED; i++) {
+        pool->compact_pinned[i] = -1;
     }
+    pool->compact_pinned_next = 0;
+    pool->deferred_head = -1;
+    pool->drain_lock = 0;
+    __builtin_memset(pool->stats, 0, sizeof(pool->stats));
 
-    // Find the maximum rank that fits in pgcount
+    // Seed the largest block that starts at each offset: it is limited by
+    // the offset's alignment (its lowest set bit) and by the pages left
     int current_page = 0;
     while (current_page < pgcount) {
-        int best_rank = 0;
-        // Find largest rank that fits
-        for (int r = MAXRANK; r >= 1; r--) {
-            int pages_needed = 1 << (r - 1);
-            // Check if block is aligned and fits
-            if ((current_page % pages_needed == 0) && (current_page + pages_needed <= pgcount)) {
-                best_rank = r;
-                break;
-            }
+        int fit_rank = 32 - __builtin_clz(pgcount - current_page);
+        int best_rank = current_page == 0 ? MAXRANK
+                                          : __builtin_ctz(current_page) + 1;
+        if (best_rank > fit_rank) {
+            best_rank = fit_rank;
         }
-
-        if (best_rank > 0) {
-            add_to_free_list(current_page, best_rank);
-            current_page += (1 << (best_rank - 1));
-        } else {
-            current_page++;
+        if (best_rank > MAXRANK) {
+            best_rank = MAXRANK;
         }
+        add_to_free_list(pool, current_page, best_rank);
+        current_page += 1 << (best_rank - 1);
     }
 
+    TRACE(pool, BUDDY_TRACE_INIT, 0, pgcount);
     return OK;
 }
 
-void *alloc_pages(int rank) {
-    if (rank < 1 || rank > MAXRANK) {
-        return ERR_PTR(-EINVAL);
+int buddy_pool_init(buddy_pool_t *pool, void *p, int pgcount) {
+    return buddy_pool_init_ex(pool, p, pgcount, NULL, 0);
+}
+
+int buddy_pool_init_meta(buddy_pool_t *pool, void *p, int pgcount, void *meta) {
+    return buddy_pool_init_ex(pool, p, pgcount, meta, 0);
+}
+
+int buddy_pool_add_region(buddy_pool_t *pool, void *p, int pgcount) {
+    if (pool == NULL || p == NULL || pgcount <= 0 ||
+        (unsigned long)p % PAGE_SIZE != 0 || (pool->flags & BUDDY_POOL_SHARED)) {
+        return -EINVAL;
     }
 
-    // Find available block of requested rank or larger
-    int found_rank = -1;
-    for (int r = rank; r <= MAXRANK; r++) {
-        if (free_lists[r] != NULL) {
-            found_rank = r;
-            break;
+    lock_word(pool, &pool->zone_lock);
+    struct buddy_zone_table *old = pool->zones;
+    int nzones = old != NULL ? old->nzones : 1;
+    char *start = p;
+    char *end = start + (long)pgcount * PAGE_SIZE;
+    for (int z = 0; z < nzones; z++) {
+        buddy_pool_t *zone = old != NULL ? old->zone[z] : pool;
+        char *zone_start = pool_memory(zone);
+        if (start < zone_start + (long)zone->total_pages * PAGE_SIZE &&
+            zone_start < end) {
+            unlock_word(pool, &pool->zone_lock);
+            return -EINVAL;  // Overlaps a zone
         }
     }
 
-    if (found_rank == -1) {
-        return ERR_PTR(-ENOSPC);
+    // The zone and the new table live in the last pages of the region,
+    // its metadata is carved in front of them
+    unsigned long tail = sizeof(buddy_pool_t) + sizeof(struct buddy_zone_table) +
+                         (nzones + 1) * sizeof(buddy_pool_t *);
+    int tail_pages = (tail + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (tail_pages >= pgcount) {
+        unlock_word(pool, &pool->zone_lock);
+        return -EINVAL;
+    }
+    buddy_pool_t *zone = (buddy_pool_t *)(start + (long)(pgcount - tail_pages) * PAGE_SIZE);
+    int ret = buddy_pool_init_ex(zone, p, pgcount - tail_pages, NULL, pool->flags);
+    if (ret != OK) {
+        unlock_word(pool, &pool->zone_lock);
+        return ret;
+    }
+    zone->lazy_limit = pool->lazy_limit;
+
+    struct buddy_zone_table *table = (struct buddy_zone_table *)(zone + 1);
+    table->nzones = 0;
+    for (int z = 0; z < nzones; z++) {
+        buddy_pool_t *next = old != NULL ? old->zone[z] : pool;
+        if (zone != NULL && pool_memory(next) > start) {
+            table->zone[table->nzones++] = zone;
+            zone = NULL;
+        }
+        table->zone[table->nzones++] = next;
     }
+    if (zone != NULL) {
+        table->zone[table->nzones++] = zone;
+    }
+    __atomic_store_n(&pool->zones, table, __ATOMIC_RELEASE);
+    unlock_word(pool, &pool->zone_lock);
+    return OK;
+}
 
-    // Remove block from free list
-    free_block_t *block = free_lists[found_rank];
-    free_lists[found_rank] = block->next;
+// Helper function to pop the head of the lowest non-empty free list at or
+// above rank, preferring warm blocks over cold ones; grouped pools find
+// blocks below the pageblock rank for class cls. Returns the page index
+// and stores the block's rank in *found and whether it was cold in
+// *cold, or returns -1 if no such block exists.
+static int take_free_block(buddy_pool_t *pool, int rank, int cls, int *found,
+                           int *cold);
 
-    int page_idx = ((char *)block - (char *)memory_start) / PAGE_SIZE;
+// Helper function to free a zone's queue of deferred frees; returns the
+// number of blocks freed
+static int drain_zone(buddy_pool_t *pool);
 
-    // Split blocks down to requested rank
-    while (found_rank > rank) {
-        found_rank--;
-        int buddy_idx = page_idx + (1 << (found_rank - 1));
-        add_to_free_list(buddy_idx, found_rank);
+// Helper function to merge the free buddies among the blocks pushed onto
+// one of a rank's lists since it was last coalesced. Those blocks form a
+// prefix of the list, and every pair of free buddies has its later
+// member in it (buddies below the pageblock rank share their pageblock,
+// so they are on the same list). Merged blocks move to the next rank,
+// still unmerged there. Called with the rank locked; takes the next
+// rank's lock (ranks nest upwards).
+static void coalesce_list(buddy_pool_t *pool, struct buddy_free_area *area, int rank) {
+    int todo = area->pending;
+    __atomic_store_n(&area->pending, 0, __ATOMIC_RELAXED);
+    if (rank == MAXRANK) {
+        return;
     }
 
-    // Mark pages as allocated
     int pages_in_block = 1 << (rank - 1);
-    for (int i = 0; i < pages_in_block; i++) {
-        page_rank[page_idx + i] = rank | ALLOCATED_BIT;  // Allocated block
+    int page_idx = area->head;
+    while (page_idx >= 0 && todo-- > 0) {
+        int next = block_links(pool, page_idx)->next;
+        int buddy_idx = get_buddy_index(page_idx, rank);
+        if (buddy_idx + pages_in_block <= pool->total_pages &&
+            is_free_block(pool, buddy_idx, rank)) {
+            if (next == buddy_idx) {
+                next = block_links(pool, next)->next;
+            }
+            remove_from_free_list(pool, page_idx, rank);
+            remove_from_free_list(pool, buddy_idx, rank);
+            set_rank_byte(pool, page_idx, 0);
+            set_rank_byte(pool, buddy_idx, 0);
+            lock_rank(pool, rank + 1);
+            add_to_free_list(pool, page_idx < buddy_idx ? page_idx : buddy_idx,
+                             rank + 1);
+            unlock_rank(pool, rank + 1);
+            STAT_ADD(pool, merges, 1);
+        }
+        page_idx = next;
     }
+}
 
-    return (void *)block;
+static void coalesce_rank(buddy_pool_t *pool, int rank) {
+    struct buddy_free_area *lists[1 + BUDDY_CLASSES];
+    int n = rank_lists(pool, rank, lists);
+    for (int l = 0; l < n; l++) {
+        coalesce_list(pool, lists[l], rank);
+    }
 }
 
-int return_pages(void *p) {
-    if (p == NULL) {
-        return -EINVAL;
+// Helper function to coalesce every rank whose unmerged backlog is above
+// limit, starting at rank and stopping at the first rank within it
+static void coalesce_above(buddy_pool_t *pool, int rank, int limit) {
+    for (; rank < MAXRANK; rank++) {
+        struct buddy_free_area *lists[1 + BUDDY_CLASSES];
+        int n = rank_lists(pool, rank, lists);
+        int pending = 0;
+        for (int l = 0; l < n; l++) {
+            pending += __atomic_load_n(&lists[l]->pending, __ATOMIC_RELAXED);
+        }
+        if (pending <= limit) {
+            break;
+        }
+        lock_rank(pool, rank);
+        coalesce_rank(pool, rank);
+        unlock_rank(pool, rank);
     }
+}
 
-    int page_idx = get_page_index(p);
-    if (page_idx < 0) {
-        return -EINVAL;
+void buddy_pool_coalesce(buddy_pool_t *pool) {
+    for (int rank = 1; rank < MAXRANK; rank++) {
+        lock_rank(pool, rank);
+        coalesce_rank(pool, rank);
+        unlock_rank(pool, rank);
     }
 
-    // Get the rank of this allocation
-    int rank_byte = page_rank[page_idx];
-    if ((rank_byte & ALLOCATED_BIT) == 0) {
-        return -EINVAL;  // Not allocated
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        buddy_pool_coalesce(zone);
     }
-    int rank = rank_byte & 0x7F;
-    if (rank == 0 || rank > MAXRANK) {
+}
+
+int buddy_pool_reclaim(buddy_pool_t *pool, int min_rank,
+                       buddy_decommit_fn decommit, void *arg) {
+    if (pool == NULL || decommit == NULL || min_rank < 1 || min_rank > MAXRANK ||
+        !(pool->flags & BUDDY_POOL_OFFPAGE)) {
         return -EINVAL;
     }
 
-    // Try to merge with buddy
-    while (rank < MAXRANK) {
-        int pages_in_block = 1 << (rank - 1);
-        int buddy_idx = get_buddy_index(page_idx, rank);
+    // Settle deferred merges first so the largest blocks get reclaimed
+    if (pool->lazy_limit > 0) {
+        buddy_pool_coalesce(pool);
+    }
 
-        // Check if buddy exists and is in range
-        if (buddy_idx < 0 || buddy_idx + pages_in_block > total_pages) {
-            break;
+    int pages = 0;
+    for (int rank = min_rank; rank <= MAXRANK; rank++) {
+        lock_rank(pool, rank);
+        struct buddy_free_area *lists[1 + BUDDY_CLASSES];
+        int n = rank_lists(pool, rank, lists);
+        for (int l = 0; l < n; l++) {
+            int page_idx;
+            while ((page_idx = lists[l]->head) >= 0) {
+                decommit(page_addr(pool, page_idx),
+                         (unsigned long)PAGE_SIZE << (rank - 1), arg);
+                remove_from_free_list(pool, page_idx, rank);
+                add_to_cold_list(pool, page_idx, rank);
+                pages += 1 << (rank - 1);
+            }
         }
+        unlock_rank(pool, rank);
+    }
 
-        // Quick check: buddy should be free with the same rank
-        // Free blocks have rank without ALLOCATED_BIT
-        if (page_rank[buddy_idx] != rank) {
-            break;  // Buddy is not free with the same rank
-        }
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        pages += buddy_pool_reclaim(zone, min_rank, decommit, arg);
+    }
+    return pages;
+}
 
-        // Remove buddy from free list
-        remove_from_free_list(buddy_idx, rank);
+int buddy_pool_set_lazy(buddy_pool_t *pool, int limit) {
+    if (pool == NULL || limit < 0) {
+        return -EINVAL;
+    }
+    if (limit == 0) {
+        // Back to eager merging: settle everything that was deferred. This
+        // must happen before the limit drops, while the blocks it merges
+        // are still counted as pending for the rank above.
+        buddy_pool_coalesce(pool);
+    }
+    pool->lazy_limit = limit;
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        zone->lazy_limit = limit;
+    }
+    return OK;
+}
 
-        // Merge with buddy
-        if (buddy_idx < page_idx) {
-            page_idx = buddy_idx;
+// Helper function to pop a block off the free list area of rank, which
+// is locked and not empty, preferring warm blocks over cold ones
+static int pop_free_block(buddy_pool_t *pool, struct buddy_free_area *area, int cls,
+                          int rank, int *cold) {
+    int page_idx = area->head;
+    if (pool->flags & BUDDY_POOL_ADDRESS_ORDERED) {
+        // Take the lowest block instead of the head. It may be anywhere in
+        // the list, so pending is left alone: a longer coalescing walk is
+        // harmless, a shorter one could miss a pair of buddies.
+        page_idx = bitmap_first(bitmap_words(pool), pool->free_bitmap[rank]);
+        page_idx <<= rank - 1;
+        remove_from_free_list(pool, page_idx, rank);
+    } else if (page_idx < 0) {
+        // Only cold blocks left at this rank
+        page_idx = area->cold_head;
+        remove_from_free_list(pool, page_idx, rank);
+    } else {
+        // Remove block from free list
+        check_links(pool, page_idx, rank);
+        int next = block_links(pool, page_idx)->next;
+        area->head = next;
+        if (next >= 0) {
+            block_links(pool, next)->prev = -1;
+        }
+        count_listed(pool, area, cls, rank, -1, 0);
+        if (pool->flags & BUDDY_POOL_ADDRESS_INDEX) {
+            bitmap_clear(bitmap_words(pool), pool->free_bitmap[rank],
+                         page_idx >> (rank - 1));
+        }
+        int pending = area->pending;
+        if (pending > 0) {
+            __atomic_store_n(&area->pending, pending - 1, __ATOMIC_RELAXED);
         }
-        rank++;
     }
 
-    // Add merged block to free list (marks pages as free)
-    add_to_free_list(page_idx, rank);
+    // Clear the free mark before dropping the lock so that a concurrent
+    // return of its buddy does not try to merge with it
+    *cold = (get_rank_byte(pool, page_idx) & COLD_BIT) != 0;
+    set_rank_byte(pool, page_idx, 0);
+    return page_idx;
+}
 
-    return OK;
+// Helper function to take a block from the lowest non-empty list among
+// the ranks in avail, class cls's lists or the shared ones for -1
+static int take_from_lists(buddy_pool_t *pool, unsigned int avail, int cls,
+                           int *found, int *cold) {
+    for (; avail != 0; avail &= avail - 1) {
+        int rank = __builtin_ctz(avail);
+        struct buddy_free_area *area =
+            cls < 0 ? &pool->area[rank] : &pool->class_area[cls][rank];
+        lock_rank(pool, rank);
+        if (area->head >= 0 || area->cold_head >= 0) {
+            int page_idx = pop_free_block(pool, area, cls, rank, cold);
+            unlock_rank(pool, rank);
+            *found = rank;
+            return page_idx;
+        }
+        // Another thread emptied this list since the mask was read
+        unlock_rank(pool, rank);
+    }
+    return -1;
 }
 
-int query_ranks(void *p) {
-    int page_idx = get_page_index(p);
-    if (page_idx < 0) {
-        return -EINVAL;
+// Classes to steal from when a class has nothing free, in order
+static const unsigned char fallbacks[BUDDY_CLASSES][BUDDY_CLASSES - 1] = {
+    [BUDDY_CLASS_UNMOVABLE] = {BUDDY_CLASS_RECLAIMABLE, BUDDY_CLASS_MOVABLE},
+    [BUDDY_CLASS_RECLAIMABLE] = {BUDDY_CLASS_UNMOVABLE, BUDDY_CLASS_MOVABLE},
+    [BUDDY_CLASS_MOVABLE] = {BUDDY_CLASS_RECLAIMABLE, BUDDY_CLASS_UNMOVABLE},
+};
+
+// Helper function to move pageblock pb to class cls after `taken` of its
+// pages were stolen for it, provided that with them at least half of it
+// is free or allocated to cls: a pageblock that earlier steals already
+// filled with the class is claimed sooner, as Linux's alike pages are.
+// Its free blocks are unlisted under their old class, then listed under
+// the new one, with every rank below the pageblock locked.
+static void steal_pageblock(buddy_pool_t *pool, int pb, int cls, int taken) {
+    int pageblock_rank = pool->pageblock_rank;
+    int start = pb << (pageblock_rank - 1);
+    int end = start + (1 << (pageblock_rank - 1));
+    if (end > pool->total_pages) {
+        end = pool->total_pages;
+    }
+    for (int r = 1; r < pageblock_rank; r++) {
+        lock_rank(pool, r);
     }
 
-    // Return the stored rank (mask out the allocated bit)
-    int rank_byte = page_rank[page_idx];
-    int rank = rank_byte & 0x7F;
-    if (rank > 0 && rank <= MAXRANK) {
-        return rank;
+    // Free blocks have stable marks while their ranks are locked; a zero
+    // mark is an interior page or a block on its way in or out
+    int usable = taken;
+    for (int pass = 0; pass < 3; pass++) {
+        for (int idx = start; idx < end;) {
+            int byte = get_rank_byte(pool, idx);
+            if (byte == 0) {
+                idx++;
+                continue;
+            }
+            int rank = byte & RANK_MASK;
+            if (pass == 0 && (byte & ALLOCATED_BIT)) {
+                if (__atomic_load_n(&page_classes(pool)[idx], __ATOMIC_RELAXED) == cls) {
+                    usable += 1 << (rank - 1);
+                }
+            } else if (!(byte & ALLOCATED_BIT)) {
+                if (pass == 0) {
+                    usable += 1 << (rank - 1);
+                } else if (pass == 1) {
+                    remove_from_free_list(pool, idx, rank);
+                } else if (byte & COLD_BIT) {
+                    add_to_cold_list(pool, idx, rank);
+                } else {
+                    add_to_free_list(pool, idx, rank);
+                }
+            }
+            idx += 1 << (rank - 1);
+        }
+        if (pass == 0 && 2 * usable < 1 << (pageblock_rank - 1)) {
+            break;  // Mostly in use by other classes; leave it there
+        }
+        if (pass == 1) {
+            __atomic_store_n(&block_classes(pool)[pb], (unsigned char)cls,
+                             __ATOMIC_RELAXED);
+        }
     }
 
-    return -EINVAL;
+    for (int r = pageblock_rank - 1; r >= 1; r--) {
+        unlock_rank(pool, r);
+    }
 }
 
-int query_page_counts(int rank) {
-    if (rank < 1 || rank > MAXRANK) {
-        return -EINVAL;
+// Helper function behind take_free_block() for requests of class cls
+// below the pageblock rank of a grouped pool
+static int take_class_block(buddy_pool_t *pool, int rank, int cls, int *found,
+                            int *cold) {
+    int pageblock_rank = pool->pageblock_rank;
+    unsigned int below = ((1u << pageblock_rank) - 1) & (~0u << rank);
+
+    // The class's own pageblocks first
+    int page_idx = take_from_lists(
+        pool, __atomic_load_n(&pool->class_mask[cls], __ATOMIC_RELAXED) & below, cls,
+        found, cold);
+    if (page_idx >= 0) {
+        return page_idx;
     }
 
-    int count = 0;
-    free_block_t *current = free_lists[rank];
-    while (current != NULL) {
-        count++;
-        current = current->next;
+    // Then a free pageblock or larger block. Only its first pageblock is
+    // split below the pageblock rank, and that one joins the class; the
+    // block is ours, so none of its pages are on a list.
+    page_idx = take_from_lists(
+        pool, __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED) & (~0u << pageblock_rank),
+        -1, found, cold);
+    if (page_idx >= 0) {
+        __atomic_store_n(&block_classes(pool)[page_idx >> (pageblock_rank - 1)],
+                         (unsigned char)cls, __ATOMIC_RELAXED);
+        return page_idx;
     }
 
-    return count;
+    // Last, steal the largest block another class has, so that the
+    // fewest steals are needed; a large one takes its pageblock along
+    for (int f = 0; f < BUDDY_CLASSES - 1; f++) {
+        int from = fallbacks[cls][f];
+        unsigned int avail =
+            __atomic_load_n(&pool->class_mask[from], __ATOMIC_RELAXED) & below;
+        while (avail != 0) {
+            int r = 31 - __builtin_clz(avail);
+            page_idx = take_from_lists(pool, 1u << r, from, found, cold);
+            if (page_idx >= 0) {
+                if (2 * (r - 1) >= pageblock_rank - 1 || cls != BUDDY_CLASS_MOVABLE) {
+                    steal_pageblock(pool, page_idx >> (pageblock_rank - 1), cls,
+                                    1 << (r - 1));
+                }
+                return page_idx;
+            }
+            avail &= ~(1u << r);
+        }
+    }
+    return -1;
+}
+
+// Helper function for an allocation about to fail on its attempt-th try:
+// queued frees and deferred merges may still produce a large enough
+// block. Returns 1 if there were any to settle; deferred merges are only
+// settled on the first try.
+static int settle_frees(buddy_pool_t *pool, int attempt) {
+    int settled = 0;
+    // A drain in progress holds blocks taken off the queue: wait for it.
+    // Frees keep coming in while other threads run, so this is worth a
+    // retry for as long as there are any.
+    if (__atomic_load_n(&pool->deferred_head, __ATOMIC_RELAXED) >= 0 ||
+        __atomic_load_n(&pool->drain_lock, __ATOMIC_RELAXED) != 0) {
+        drain_zone(pool);
+        settled = 1;
+    }
+    if (pool->lazy_limit > 0 && attempt == 0) {
+        buddy_pool_coalesce(pool);
+        settled = 1;
+    }
+    return settled;
+}
+
+static int take_free_block(buddy_pool_t *pool, int rank, int cls, int *found,
+                           int *cold) {
+    for (int attempt = 0;; attempt++) {
+        // Find available block of requested rank or larger: lowest
+        // non-empty rank at or above the request
+        int page_idx;
+        if (rank < pool->pageblock_rank) {
+            page_idx = take_class_block(pool, rank, cls, found, cold);
+        } else {
+            page_idx = take_from_lists(
+                pool, __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED) & (~0u << rank),
+                -1, found, cold);
+        }
+        if (page_idx >= 0 || !settle_frees(pool, attempt)) {
+            return page_idx;
+        }
+    }
+}
+
+// Helper function to put a block split off during allocation on its list
+static void push_split_block(buddy_pool_t *pool, int page_idx, int rank,
+                             int cold) {
+    lock_rank(pool, rank);
+    if (cold) {
+        add_to_cold_list(pool, page_idx, rank);
+    } else {
+        add_to_free_list(pool, page_idx, rank);
+    }
+    unlock_rank(pool, rank);
+}
+
+// Helper function behind buddy_pool_alloc_class(), without tracing
+static void *alloc_block(buddy_pool_t *pool, int rank, int cls) {
+    if (rank < 1 || rank > MAXRANK || cls < 0 || cls >= BUDDY_CLASSES) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    int found_rank, cold;
+    int page_idx = take_free_block(pool, rank, cls, &found_rank, &cold);
+    if (page_idx < 0) {
+        STAT_ADD(pool, enospc[rank], 1);
+        return ERR_PTR(-ENOSPC);
+    }
+    STAT_ADD(pool, alloc[rank], 1);
+    STAT_ADD(pool, splits, found_rank - rank);
+
+    // Split blocks down to requested rank
+    while (found_rank > rank) {
+        found_rank--;
+        int buddy_idx = page_idx + (1 << (found_rank - 1));
+        push_split_block(pool, buddy_idx, found_rank, cold);
+    }
+
+    // Mark the head page as allocated; interior pages stay zero
+    set_page_class(pool, page_idx, cls);
+    set_rank_byte(pool, page_idx, rank | ALLOCATED_BIT);
+
+    return page_addr(pool, page_idx);
+}
+
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank) {
+    return buddy_pool_alloc_class(pool, rank, BUDDY_CLASS_UNMOVABLE);
+}
+
+void *buddy_pool_alloc_class(buddy_pool_t *pool, int rank, int cls) {
+    void *p = alloc_block(pool, rank, cls);
+#ifdef BUDDY_TRACE
+    if (!IS_ERR(p)) {
+        TRACE(pool, BUDDY_TRACE_ALLOC, rank, get_page_index(pool, p));
+    } else if (PTR_ERR(p) == -ENOSPC) {
+        TRACE(pool, BUDDY_TRACE_ENOSPC, rank, -1);
+    }
+#endif
+    if (IS_ERR(p) && PTR_ERR(p) == -ENOSPC) {
+        // Fall back to the other zones
+        buddy_pool_t *zone;
+        for_each_region(pool, zone) {
+            p = buddy_pool_alloc_class(zone, rank, cls);
+            if (!IS_ERR(p)) {
+                break;
+            }
+        }
+    }
+    return p;
+}
+
+// Helper function behind buddy_pool_alloc_bulk() for one zone. Returns
+// the number of blocks allocated, 0 if there were none.
+static int zone_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out) {
+    int got = 0;
+    int block_pages = 1 << (rank - 1);
+    while (got < n) {
+        int found_rank, cold;
+        int page_idx = take_free_block(pool, rank, BUDDY_CLASS_UNMOVABLE, &found_rank,
+                                       &cold);
+        if (page_idx < 0) {
+            break;
+        }
+
+        // Carve as many rank-sized blocks out of it as are still needed.
+        // Halves that are entirely needed are taken whole, the first half
+        // that is not needed at all goes back to its free list.
+        int need = n - got;
+        if (need > (1 << (found_rank - rank))) {
+            need = 1 << (found_rank - rank);
+        }
+        int first = got, pushed = 0;
+        while (need < (1 << (found_rank - rank))) {
+            found_rank--;
+            int half_units = 1 << (found_rank - rank);
+            int half_idx = page_idx + (1 << (found_rank - 1));
+            if (need <= half_units) {
+                push_split_block(pool, half_idx, found_rank, cold);
+                pushed++;
+            } else {
+                for (int i = 0; i < half_units; i++) {
+                    int idx = page_idx + i * block_pages;
+                    set_page_class(pool, idx, BUDDY_CLASS_UNMOVABLE);
+                    set_rank_byte(pool, idx, rank | ALLOCATED_BIT);
+                    out[got++] = page_addr(pool, idx);
+                }
+                need -= half_units;
+                page_idx = half_idx;
+            }
+        }
+        for (int i = 0; i < need; i++) {
+            int idx = page_idx + i * block_pages;
+            set_page_class(pool, idx, BUDDY_CLASS_UNMOVABLE);
+            set_rank_byte(pool, idx, rank | ALLOCATED_BIT);
+            out[got++] = page_addr(pool, idx);
+        }
+        // As many splits as one-at-a-time allocation would have made
+        STAT_ADD(pool, splits, got - first + pushed - 1);
+    }
+
+    STAT_ADD(pool, alloc[rank], got);
+    if (got < n) {
+        STAT_ADD(pool, enospc[rank], 1);
+    }
+#ifdef BUDDY_TRACE
+    for (int i = 0; i < got; i++) {
+        TRACE(pool, BUDDY_TRACE_ALLOC, rank, get_page_index(pool, out[i]));
+    }
+    if (got < n) {
+        TRACE(pool, BUDDY_TRACE_ENOSPC, rank, -1);
+    }
+#endif
+    return got;
+}
+
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out) {
+    if (rank < 1 || rank > MAXRANK || n < 0 || (n > 0 && out == NULL)) {
+        return -EINVAL;
+    }
+
+    int got = zone_alloc_bulk(pool, rank, n, out);
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        if (got == n) {
+            break;
+        }
+        got += zone_alloc_bulk(zone, rank, n - got, out + got);
+    }
+    if (got == 0 && n > 0) {
+        return -ENOSPC;
+    }
+    return got;
+}
+
+// Placement constraint of buddy_pool_alloc_constrained(): block heads
+// that may be handed out are phase + k * step, within [lo, hi) pages
+struct placement {
+    int lo;
+    int hi;
+    int step;
+    int phase;
+    int pages;  // Size of the requested block
+};
+
+// Helper function to get the first allowed head at or after page_idx
+static inline int next_placement(const struct placement *c, int page_idx) {
+    if (page_idx <= c->phase) {
+        return c->phase;
+    }
+    return c->phase + ((page_idx - c->phase + c->step - 1) & ~(c->step - 1));
+}
+
+// Helper function to find a free block of rank holding an allowed head,
+// with its rank locked. Returns the block and sets *head, or -1.
+static int find_placement(buddy_pool_t *pool, int rank, const struct placement *c,
+                          int *head) {
+    // Visit the free blocks of the range in address order, skipping ahead
+    // to the block of the next allowed head after each miss
+    int size = 1 << (rank - 1);
+    int nbits = pool->total_pages >> (rank - 1);
+    int bit = c->lo >> (rank - 1);
+    unsigned long *words = bitmap_words(pool);
+    while ((bit = bitmap_next(words, pool->free_bitmap[rank], nbits, bit)) >= 0) {
+        int block = bit << (rank - 1);
+        if (block >= c->hi) {
+            break;
+        }
+        int idx = next_placement(c, block > c->lo ? block : c->lo);
+        int end = block + size < c->hi ? block + size : c->hi;
+        if (idx <= end - c->pages) {
+            *head = idx;
+            return block;
+        }
+        int next = next_placement(c, block + size);
+        if (next >= c->hi) {
+            break;
+        }
+        bit = next >> (rank - 1);
+    }
+    return -1;
+}
+
+// Helper function behind buddy_pool_alloc_constrained() for one zone
+static void *alloc_placed_block(buddy_pool_t *pool, int rank, int min_align_rank,
+                                unsigned long lo_addr, unsigned long hi_addr) {
+    unsigned long base = (unsigned long)pool_memory(pool);
+    unsigned long end = base + ((unsigned long)pool->total_pages << PAGE_SHIFT);
+    if (lo_addr < base) {
+        lo_addr = base;
+    }
+    if (hi_addr > end) {
+        hi_addr = end;
+    }
+    if (lo_addr >= hi_addr) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    // Heads are multiples of the block size within the pool; an alignment
+    // above it also fixes their phase against the pool's start address
+    struct placement c;
+    c.lo = (lo_addr - base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    c.hi = (hi_addr - base) >> PAGE_SHIFT;
+    c.pages = 1 << (rank - 1);
+    c.step = c.pages;
+    c.phase = 0;
+    if (min_align_rank > rank) {
+        unsigned long misalign = -base & ((PAGE_SIZE << (min_align_rank - 1)) - 1);
+        c.step = 1 << (min_align_rank - 1);
+        c.phase = misalign >> PAGE_SHIFT;
+        if ((misalign & (PAGE_SIZE - 1)) || (c.phase & (c.pages - 1))) {
+            return ERR_PTR(-ENOSPC);  // No head of the pool is that aligned
+        }
+    } else if (min_align_rank > 0 &&
+               (base & ((PAGE_SIZE << (min_align_rank - 1)) - 1))) {
+        return ERR_PTR(-ENOSPC);  // Likewise, for every head
+    }
+
+    int found_rank = rank, block = -1, head = 0;
+    for (int attempt = 0; block < 0; attempt++) {
+        unsigned int avail = __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED) &
+                             (~0u << rank);
+        for (; avail != 0; avail &= avail - 1) {
+            found_rank = __builtin_ctz(avail);
+            lock_rank(pool, found_rank);
+            block = find_placement(pool, found_rank, &c, &head);
+            if (block >= 0) {
+                break;  // Still locked
+            }
+            unlock_rank(pool, found_rank);
+        }
+        if (block < 0 && !settle_frees(pool, attempt)) {
+            STAT_ADD(pool, enospc[rank], 1);
+            return ERR_PTR(-ENOSPC);
+        }
+    }
+    int cold = (get_rank_byte(pool, block) & COLD_BIT) != 0;
+    remove_from_free_list(pool, block, found_rank);
+    set_rank_byte(pool, block, 0);
+    unlock_rank(pool, found_rank);
+    STAT_ADD(pool, alloc[rank], 1);
+    STAT_ADD(pool, splits, found_rank - rank);
+
+    // Split towards the head, freeing the halves that do not contain it
+    while (found_rank > rank) {
+        found_rank--;
+        int half = 1 << (found_rank - 1);
+        if (head >= block + half) {
+            push_split_block(pool, block, found_rank, cold);
+            block += half;
+        } else {
+            push_split_block(pool, block + half, found_rank, cold);
+        }
+    }
+    set_page_class(pool, block, BUDDY_CLASS_UNMOVABLE);
+    set_rank_byte(pool, block, rank | ALLOCATED_BIT);
+    return page_addr(pool, block);
+}
+
+void *buddy_pool_alloc_constrained(buddy_pool_t *pool, int rank, int min_align_rank,
+                                   unsigned long lo_addr, unsigned long hi_addr) {
+    if (pool == NULL || rank < 1 || rank > MAXRANK || min_align_rank < 0 ||
+        min_align_rank > MAXRANK || lo_addr >= hi_addr || !has_bitmaps(pool->flags)) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    void *p = alloc_placed_block(pool, rank, min_align_rank, lo_addr, hi_addr);
+#ifdef BUDDY_TRACE
+    if (!IS_ERR(p)) {
+        TRACE(pool, BUDDY_TRACE_ALLOC, rank, get_page_index(pool, p));
+    } else {
+        TRACE(pool, BUDDY_TRACE_ENOSPC, rank, -1);
+    }
+#endif
+    if (IS_ERR(p)) {
+        buddy_pool_t *zone;
+        for_each_region(pool, zone) {
+            p = buddy_pool_alloc_constrained(zone, rank, min_align_rank, lo_addr,
+                                             hi_addr);
+            if (!IS_ERR(p)) {
+                break;
+            }
+        }
+    }
+    return p;
+}
+
+// Helper function behind buddy_pool_return(), without tracing or free
+// counts. Returns the rank of the released block.
+static int release_pages(buddy_pool_t *pool, void *p) {
+    if (p == NULL) {
+        return -EINVAL;
+    }
+
+    int page_idx = get_page_index(pool, p);
+    if (page_idx < 0) {
+        return -EINVAL;
+    }
+
+    // Get the rank of this allocation
+    int rank_byte = get_rank_byte(pool, page_idx);
+    if ((rank_byte & (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT) {
+        return -EINVAL;  // Not allocated, part of an exact range or cached
+    }
+    int rank = rank_byte & RANK_MASK;
+    if (rank == 0 || rank > MAXRANK) {
+        return -EINVAL;
+    }
+
+    // The head mark is rewritten by add_to_free_list() for the merged block
+    if (!claim_block(pool, page_idx, rank_byte, 0)) {
+        return -EINVAL;  // Freed by another thread meanwhile
+    }
+
+    if (pool->lazy_limit > 0) {
+        // Defer merging until this rank's backlog grows past the limit
+        lock_rank(pool, rank);
+        add_to_free_list(pool, page_idx, rank);
+        unlock_rank(pool, rank);
+        coalesce_above(pool, rank, pool->lazy_limit);
+        return rank_byte & RANK_MASK;
+    }
+
+    // Try to merge with buddy. Each rank's check and the final insertion
+    // happen under that rank's lock, so two free buddies are never left
+    // unmerged.
+    for (;;) {
+        lock_rank(pool, rank);
+        if (rank == MAXRANK) {
+            break;
+        }
+
+        int pages_in_block = 1 << (rank - 1);
+        int buddy_idx = get_buddy_index(page_idx, rank);
+
+        // Check if buddy exists and is in range
+        if (buddy_idx < 0 || buddy_idx + pages_in_block > pool->total_pages) {
+            break;
+        }
+
+        // Quick check: buddy should be free with the same rank
+        // Free blocks have rank without ALLOCATED_BIT; a cold buddy merges
+        // too, the merged block counts as warm
+        if (!is_free_block(pool, buddy_idx, rank)) {
+            break;  // Buddy is not free with the same rank
+        }
+
+        // Remove buddy from free list; its head becomes an interior page
+        remove_from_free_list(pool, buddy_idx, rank);
+        set_rank_byte(pool, buddy_idx, 0);
+        unlock_rank(pool, rank);
+
+        // Merge with buddy
+        if (buddy_idx < page_idx) {
+            page_idx = buddy_idx;
+        }
+        rank++;
+    }
+
+    // Add merged block to free list (marks pages as free)
+    add_to_free_list(pool, page_idx, rank);
+    unlock_rank(pool, rank);
+
+    STAT_ADD(pool, merges, rank - (rank_byte & RANK_MASK));
+    return rank_byte & RANK_MASK;
+}
+
+// Helper function behind buddy_pool_return() for deferred pools: claim
+// the block by marking it cached and push it onto the zone's queue, its
+// list link being free to use now. Returns the block's rank.
+static int queue_pages(buddy_pool_t *pool, void *p) {
+    int page_idx = p == NULL ? -1 : get_page_index(pool, p);
+    int rank_byte = page_idx < 0 ? 0 : get_rank_byte(pool, page_idx);
+    int rank = rank_byte & RANK_MASK;
+    if ((rank_byte & (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT ||
+        rank == 0 || rank > MAXRANK ||
+        !claim_block(pool, page_idx, rank_byte, rank_byte | CACHED_BIT)) {
+        return -EINVAL;
+    }
+
+    free_block_t *block = block_links(pool, page_idx);
+    if (!(pool->flags & BUDDY_POOL_THREADSAFE)) {
+        block->next = pool->deferred_head;
+        pool->deferred_head = page_idx;
+        return rank;
+    }
+    // The consumer takes the whole queue at once, so a push cannot race
+    // with a pop of the same head (no ABA)
+    int head = __atomic_load_n(&pool->deferred_head, __ATOMIC_RELAXED);
+    do {
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->deferred_head, &head, page_idx, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return rank;
+}
+
+int buddy_pool_return(buddy_pool_t *pool, void *p) {
+    pool = zone_of(pool, p);
+    if (pool->flags & BUDDY_POOL_DEFERRED) {
+        // Counted and traced when drained
+        int ret = queue_pages(pool, p);
+        if (ret < 0) {
+            STAT_ADD(pool, invalid_frees, 1);
+            return ret;
+        }
+        return OK;
+    }
+    int rank = release_pages(pool, p);
+    if (rank < 0) {
+        STAT_ADD(pool, invalid_frees, 1);
+        return rank;
+    }
+    STAT_ADD(pool, free[rank], 1);
+    TRACE(pool, BUDDY_TRACE_FREE, 0, get_page_index(pool, p));
+    return OK;
+}
+
+// Helper function to sort page pointers by address (heapsort, in place)
+static void sort_pages(void **pages, int n) {
+    for (int i = n / 2 - 1; i >= 0; i--) {
+        // heapify the subtree at i
+        for (int parent = i, child; (child = 2 * parent + 1) < n; parent = child) {
+            if (child + 1 < n && (char *)pages[child + 1] > (char *)pages[child]) {
+                child++;
+            }
+            if ((char *)pages[parent] >= (char *)pages[child]) {
+                break;
+            }
+            void *tmp = pages[parent];
+            pages[parent] = pages[child];
+            pages[child] = tmp;
+        }
+    }
+    for (int end = n - 1; end > 0; end--) {
+        void *tmp = pages[0];
+        pages[0] = pages[end];
+        pages[end] = tmp;
+        for (int parent = 0, child; (child = 2 * parent + 1) < end; parent = child) {
+            if (child + 1 < end && (char *)pages[child + 1] > (char *)pages[child]) {
+                child++;
+            }
+            if ((char *)pages[parent] >= (char *)pages[child]) {
+                break;
+            }
+            tmp = pages[parent];
+            pages[parent] = pages[child];
+            pages[child] = tmp;
+        }
+    }
+}
+
+// Helper function behind buddy_pool_return_bulk() for sorted pages of
+// one zone
+static int zone_return_bulk(buddy_pool_t *pool, void **pages, int n) {
+    int ret = OK;
+
+    // Merge buddies that are both in the batch before touching the free
+    // lists. The blocks are still ours, so a merged pair simply becomes a
+    // larger allocated block. Sorted input means only the top of the
+    // stack of pending blocks (kept in the front of pages) can merge.
+    // Hardened pools skip this, so that every block is claimed alone.
+    int top = 0;
+    void *prev = NULL;
+    for (int i = 0; i < n; i++) {
+        void *p = pages[i];
+        int page_idx = p == NULL ? -1 : get_page_index(pool, p);
+        if (page_idx < 0 || p == prev ||
+            (get_rank_byte(pool, page_idx) &
+             (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT) {
+            ret = -EINVAL;  // Invalid, interior, free, exact or duplicate entry
+            STAT_ADD(pool, invalid_frees, 1);
+            continue;
+        }
+        prev = p;
+        pages[top++] = p;
+        STAT_ADD(pool, free[get_rank_byte(pool, page_idx) & RANK_MASK], 1);
+        TRACE(pool, BUDDY_TRACE_FREE, 0, page_idx);
+
+        while (top >= 2 && !(pool->flags & BUDDY_POOL_HARDENED)) {
+            int low_idx = get_page_index(pool, pages[top - 2]);
+            int high_idx = get_page_index(pool, pages[top - 1]);
+            int rank = get_rank_byte(pool, high_idx) & RANK_MASK;
+            if (rank >= MAXRANK ||
+                get_rank_byte(pool, low_idx) != (rank | ALLOCATED_BIT) ||
+                get_buddy_index(low_idx, rank) != high_idx) {
+                break;
+            }
+            set_rank_byte(pool, high_idx, 0);
+            set_rank_byte(pool, low_idx, (rank + 1) | ALLOCATED_BIT);
+            STAT_ADD(pool, merges, 1);
+            top--;
+        }
+    }
+
+    for (int i = 0; i < top; i++) {
+        if (release_pages(pool, pages[i]) < 0) {
+            ret = -EINVAL;
+            STAT_ADD(pool, invalid_frees, 1);
+        }
+    }
+    return ret;
+}
+
+#define DRAIN_BATCH 512  // Blocks sorted and freed together by drain_zone()
+
+static int drain_zone(buddy_pool_t *pool) {
+    lock_word(pool, &pool->drain_lock);
+    int page_idx = __atomic_exchange_n(&pool->deferred_head, -1, __ATOMIC_ACQUIRE);
+    int drained = 0;
+    while (page_idx >= 0) {
+        // Unlink a batch before freeing any of it: freeing rewrites the
+        // links of the blocks freed
+        void *batch[DRAIN_BATCH];
+        int n = 0;
+        for (; page_idx >= 0 && n < DRAIN_BATCH; n++) {
+            int next = block_links(pool, page_idx)->next;
+            set_rank_byte(pool, page_idx, get_rank_byte(pool, page_idx) & ~CACHED_BIT);
+            batch[n] = page_addr(pool, page_idx);
+            page_idx = next;
+        }
+        sort_pages(batch, n);
+        zone_return_bulk(pool, batch, n);
+        drained += n;
+    }
+    unlock_word(pool, &pool->drain_lock);
+    return drained;
+}
+
+int buddy_pool_drain(buddy_pool_t *pool) {
+    if (pool == NULL) {
+        return -EINVAL;
+    }
+    int drained = drain_zone(pool);
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        drained += drain_zone(zone);
+    }
+    return drained;
+}
+
+// Smallest rank whose blocks hold npages, or 0 if none does
+static int rank_for_pages(int npages) {
+    if (npages < 1 || npages > 1 << (MAXRANK - 1)) {
+        return 0;
+    }
+    return npages == 1 ? 1 : 33 - __builtin_clz(npages - 1);
+}
+
+void *buddy_pool_alloc_exact(buddy_pool_t *pool, int npages) {
+    int rank = rank_for_pages(npages);
+    if (rank == 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    void *p = alloc_block(pool, rank, BUDDY_CLASS_UNMOVABLE);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) == -ENOSPC) {
+            TRACE_EXACT(pool, BUDDY_TRACE_ENOSPC, -1, npages);
+            buddy_pool_t *zone;
+            for_each_region(pool, zone) {
+                p = buddy_pool_alloc_exact(zone, npages);
+                if (!IS_ERR(p)) {
+                    break;
+                }
+            }
+        }
+        return p;
+    }
+
+    // The range becomes one allocated piece per set bit of npages, largest
+    // first, so every piece stays aligned to its size
+    int page_idx = get_page_index(pool, p);
+    int offset = 0;
+    for (int r = rank; r >= 1; r--) {
+        if (npages & (1 << (r - 1))) {
+            set_page_class(pool, page_idx + offset, BUDDY_CLASS_UNMOVABLE);
+            set_rank_byte(pool, page_idx + offset, r | ALLOCATED_BIT | EXACT_BIT |
+                                                       (offset ? TAIL_BIT : 0));
+            offset += 1 << (r - 1);
+        }
+    }
+
+    // The tail goes back as the largest aligned blocks that fit. Each
+    // one's buddy overlaps the range, so there is nothing to merge.
+    while (offset < 1 << (rank - 1)) {
+        int r = __builtin_ctz(offset) + 1;
+        lock_rank(pool, r);
+        add_to_free_list(pool, page_idx + offset, r);
+        unlock_rank(pool, r);
+        offset += 1 << (r - 1);
+    }
+    TRACE_EXACT(pool, BUDDY_TRACE_ALLOC_EXACT, page_idx, npages);
+    return p;
+}
+
+int buddy_pool_return_exact(buddy_pool_t *pool, void *p, int npages) {
+    pool = zone_of(pool, p);
+    int rank = rank_for_pages(npages);
+    int page_idx = p == NULL ? -1 : get_page_index(pool, p);
+    if (rank == 0 || page_idx < 0 || npages > pool->total_pages - page_idx) {
+        STAT_ADD(pool, invalid_frees, 1);
+        return -EINVAL;
+    }
+
+    // Check every piece before releasing any of them, and that the range
+    // does not go on past npages
+    int offset = 0;
+    for (int r = rank; r >= 1; r--) {
+        if (npages & (1 << (r - 1))) {
+            if (get_rank_byte(pool, page_idx + offset) !=
+                (r | ALLOCATED_BIT | EXACT_BIT | (offset ? TAIL_BIT : 0))) {
+                STAT_ADD(pool, invalid_frees, 1);
+                return -EINVAL;
+            }
+            offset += 1 << (r - 1);
+        }
+    }
+    int first = get_rank_byte(pool, page_idx);
+    if ((offset < pool->total_pages - page_idx &&
+         (get_rank_byte(pool, page_idx + offset) & (EXACT_BIT | TAIL_BIT)) ==
+             (EXACT_BIT | TAIL_BIT)) ||
+        !claim_block(pool, page_idx, first, first | TAIL_BIT)) {
+        // Longer range, or freed by another thread meanwhile: the first
+        // piece is claimed by marking it as a tail, which fails any
+        // other check
+        STAT_ADD(pool, invalid_frees, 1);
+        return -EINVAL;
+    }
+
+    // Release from the end, so each piece merges with the tail freed
+    // before it
+    for (int r = 1; r <= rank; r++) {
+        if (npages & (1 << (r - 1))) {
+            offset -= 1 << (r - 1);
+            set_rank_byte(pool, page_idx + offset, r | ALLOCATED_BIT);
+            release_pages(pool, page_addr(pool, page_idx + offset));
+        }
+    }
+    STAT_ADD(pool, free[rank], 1);
+    TRACE_EXACT(pool, BUDDY_TRACE_FREE_EXACT, page_idx, npages);
+    return OK;
+}
+
+// Helper function to grow the block at page_idx to new_rank by absorbing
+// its right-hand buddies, which must all be free whole blocks. They are
+// checked and taken with every rank on the way locked, in ascending
+// order. Returns 1 if the block grew.
+static int grow_in_place(buddy_pool_t *pool, int page_idx, int rank_byte,
+                         int new_rank) {
+    int rank = rank_byte & RANK_MASK;
+    if ((page_idx & ((1 << (new_rank - 1)) - 1)) != 0 ||
+        (1 << (new_rank - 1)) > pool->total_pages - page_idx) {
+        return 0;  // Not the left half all the way up, or past the end
+    }
+    for (int r = rank; r < new_rank; r++) {
+        if (!is_free_block(pool, page_idx + (1 << (r - 1)), r)) {
+            return 0;  // Cheap early out before taking any lock
+        }
+    }
+
+    for (int r = rank; r < new_rank; r++) {
+        lock_rank(pool, r);
+    }
+    int grown = 1;
+    for (int r = rank; r < new_rank && grown; r++) {
+        grown = is_free_block(pool, page_idx + (1 << (r - 1)), r);
+    }
+    if (grown && claim_block(pool, page_idx, rank_byte, new_rank | ALLOCATED_BIT)) {
+        for (int r = rank; r < new_rank; r++) {
+            int buddy_idx = page_idx + (1 << (r - 1));
+            remove_from_free_list(pool, buddy_idx, r);
+            set_rank_byte(pool, buddy_idx, 0);
+        }
+    } else {
+        grown = 0;
+    }
+    for (int r = new_rank - 1; r >= rank; r--) {
+        unlock_rank(pool, r);
+    }
+    return grown;
+}
+
+void *buddy_pool_realloc(buddy_pool_t *pool, void *p, int new_rank) {
+    if (pool == NULL || new_rank < 1 || new_rank > MAXRANK) {
+        return ERR_PTR(-EINVAL);
+    }
+    buddy_pool_t *zone = zone_of(pool, p);
+    int page_idx = p == NULL ? -1 : get_page_index(zone, p);
+    int rank_byte = page_idx < 0 ? 0 : get_rank_byte(zone, page_idx);
+    if ((rank_byte & (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT) {
+        STAT_ADD(zone, invalid_frees, 1);
+        return ERR_PTR(-EINVAL);
+    }
+    int rank = rank_byte & RANK_MASK;
+    if (new_rank == rank) {
+        return p;
+    }
+
+    if (new_rank < rank) {
+        // Shrink: the upper halves cannot merge, their buddies are still ours
+        if (!claim_block(zone, page_idx, rank_byte, new_rank | ALLOCATED_BIT)) {
+            STAT_ADD(zone, invalid_frees, 1);
+            return ERR_PTR(-EINVAL);
+        }
+        for (int r = rank - 1; r >= new_rank; r--) {
+            push_split_block(zone, page_idx + (1 << (r - 1)), r, 0);
+        }
+        STAT_ADD(zone, splits, rank - new_rank);
+    } else if (grow_in_place(zone, page_idx, rank_byte, new_rank)) {
+        STAT_ADD(zone, merges, new_rank - rank);
+    } else {
+        // Move, keeping the block's class; on failure the block is left
+        // as it was
+        int cls = zone->page_class == 0
+                      ? BUDDY_CLASS_UNMOVABLE
+                      : __atomic_load_n(&page_classes(zone)[page_idx], __ATOMIC_RELAXED);
+        void *q = buddy_pool_alloc_class(pool, new_rank, cls);
+        if (IS_ERR(q)) {
+            return q;
+        }
+        __builtin_memcpy(q, p, PAGE_SIZE << (rank - 1));
+        buddy_pool_return(pool, p);
+        return q;
+    }
+    STAT_ADD(zone, free[rank], 1);
+    STAT_ADD(zone, alloc[new_rank], 1);
+    TRACE(zone, BUDDY_TRACE_FREE, 0, page_idx);
+    TRACE(zone, BUDDY_TRACE_ALLOC, new_rank, page_idx);
+    return p;
+}
+
+// Helper function to tell whether compaction may move the block at
+// page_idx with head mark byte: a plain allocated block, and in a grouped
+// pool only one allocated as movable
+static int is_movable_block(buddy_pool_t *pool, int page_idx, int byte) {
+    if ((byte & (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT) {
+        return 0;
+    }
+    return pool->page_class == 0 ||
+           __atomic_load_n(&page_classes(pool)[page_idx], __ATOMIC_RELAXED) ==
+               BUDDY_CLASS_MOVABLE;
+}
+
+// Helper function to size up the region of size pages at start for
+// compaction: returns the pages allocated in it, or -1 if one of its
+// blocks cannot be moved. Marks changing under a concurrent call are
+// skipped like buddy_pool_walk() does.
+static int region_cost(buddy_pool_t *pool, int start, int size) {
+    int used = 0;
+    for (int idx = start; idx < start + size;) {
+        int byte = get_rank_byte(pool, idx);
+        int rank = byte & RANK_MASK;
+        if (rank == 0 || rank > MAXRANK || (idx & ((1 << (rank - 1)) - 1)) != 0) {
+            idx++;
+            continue;
+        }
+        if (byte & ALLOCATED_BIT) {
+            if (!is_movable_block(pool, idx, byte)) {
+                return -1;
+            }
+            used += 1 << (rank - 1);
+        }
+        idx += 1 << (rank - 1);
+    }
+    return used;
+}
+
+// Helper function to tell whether the region of size pages at start holds
+// a block compaction failed to move that is still allocated
+static int region_pinned(buddy_pool_t *pool, int start, int size) {
+    for (int i = 0; i < BUDDY_COMPACT_PINNED; i++) {
+        int idx = __atomic_load_n(&pool->compact_pinned[i], __ATOMIC_RELAXED);
+        if (idx >= start && idx < start + size &&
+            (get_rank_byte(pool, idx) & ALLOCATED_BIT)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function behind buddy_pool_compact() for one zone. Returns the
+// blocks moved, or -1 if the zone has no region worth evacuating.
+static int compact_zone(buddy_pool_t *pool, int target_rank, int max_moves,
+                        buddy_move_fn move, void *arg) {
+    int size = 1 << (target_rank - 1);
+    long free_pages = 0;
+    for (int r = 1; r <= MAXRANK; r++) {
+        free_pages += (long)__atomic_load_n(&pool->area[r].count, __ATOMIC_RELAXED)
+                      << (r - 1);
+    }
+
+    // The region with the fewest allocated pages, all of them movable and
+    // fitting in the free pages outside it; the highest one of a tie, so
+    // that blocks tend to move down. Regions holding a block a past call
+    // failed to move are passed over. The scan goes on from the cursor the
+    // last call left and covers at most COMPACT_SCAN_PAGES pages; it only
+    // wraps round to the regions behind the cursor if none ahead qualify.
+    int nregions = pool->total_pages / size;
+    if (nregions == 0) {
+        return -1;
+    }
+    int limit = COMPACT_SCAN_PAGES / size;
+    if (limit < 1) {
+        limit = 1;
+    } else if (limit > nregions) {
+        limit = nregions;
+    }
+    int first = __atomic_load_n(&pool->compact_cursor, __ATOMIC_RELAXED) / size % nregions;
+    int best = -1, best_used = 0, scanned = 0;
+    for (; scanned < limit; scanned++) {
+        int i = first + scanned < nregions ? first + scanned : first + scanned - nregions;
+        if (i == 0 && scanned > 0 && best >= 0) {
+            break;
+        }
+        int start = i * size;
+        if (find_block_head(pool, start) != start || region_pinned(pool, start, size)) {
+            continue;  // Inside a larger block, or holding one that would not move
+        }
+        int used = region_cost(pool, start, size);
+        if (used > 0 && (best < 0 || used <= best_used) &&
+            free_pages - (size - used) >= used) {
+            best = start;
+            best_used = used;
+        }
+    }
+    if (best < 0) {
+        __atomic_store_n(&pool->compact_cursor, (first + scanned) % nregions * size,
+                         __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    // Evacuate it in address order, stopping at the first block that
+    // finds no room or that the owner refuses to move
+    unsigned long base = (unsigned long)pool_memory(pool);
+    unsigned long lo = base + ((unsigned long)best << PAGE_SHIFT);
+    unsigned long hi = lo + ((unsigned long)size << PAGE_SHIFT);
+    int moved = 0, stuck = -1;
+    for (int idx = best; idx < best + size && moved < max_moves;) {
+        int byte = get_rank_byte(pool, idx);
+        int rank = byte & RANK_MASK;
+        if (rank == 0 || rank > MAXRANK || (idx & ((1 << (rank - 1)) - 1)) != 0) {
+            idx++;
+            continue;
+        }
+        if (!is_movable_block(pool, idx, byte)) {
+            idx += 1 << (rank - 1);
+            continue;
+        }
+
+        void *to = alloc_placed_block(pool, rank, 0, base, lo);
+        if (IS_ERR(to)) {
+            to = alloc_placed_block(pool, rank, 0, hi, ~0UL);
+            if (IS_ERR(to)) {
+                stuck = idx;
+                break;
+            }
+        }
+        set_page_class(pool, get_page_index(pool, to), BUDDY_CLASS_MOVABLE);
+        void *from = page_addr(pool, idx);
+        if (move(from, to, rank, arg) != 0) {
+            release_pages(pool, to);
+            STAT_ADD(pool, free[rank], 1);
+            stuck = idx;
+            break;
+        }
+        TRACE(pool, BUDDY_TRACE_ALLOC, rank, get_page_index(pool, to));
+        if (release_pages(pool, from) == rank) {
+            STAT_ADD(pool, free[rank], 1);
+            TRACE(pool, BUDDY_TRACE_FREE, 0, idx);
+        }
+        moved++;
+        idx += 1 << (rank - 1);
+    }
+    // A region cut short by max_moves is picked up again by the next call,
+    // one that is empty or stuck is left behind, the block it stuck on
+    // remembered
+    if (stuck >= 0) {
+        unsigned int slot =
+            __atomic_fetch_add(&pool->compact_pinned_next, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->compact_pinned[slot % BUDDY_COMPACT_PINNED], stuck,
+                         __ATOMIC_RELAXED);
+    }
+    int next = best;
+    if (stuck >= 0 || moved < max_moves) {
+        next = best + size < nregions * size ? best + size : 0;
+    }
+    __atomic_store_n(&pool->compact_cursor, next, __ATOMIC_RELAXED);
+    if (pool->lazy_limit > 0) {
+        buddy_pool_coalesce(pool);
+    }
+    return moved;
+}
+
+int buddy_pool_compact(buddy_pool_t *pool, int target_rank, int max_moves,
+                       buddy_move_fn move, void *arg) {
+    if (pool == NULL || target_rank < 1 || target_rank > MAXRANK || max_moves < 1 ||
+        move == NULL || !has_bitmaps(pool->flags)) {
+        return -EINVAL;
+    }
+
+    // Nothing to do while a large enough block is free anywhere
+    unsigned int above = ~0u << target_rank;
+    if (__atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED) & above) {
+        return 0;
+    }
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        if (__atomic_load_n(&zone->free_mask, __ATOMIC_RELAXED) & above) {
+            return 0;
+        }
+    }
+
+    // One region per call, in the first zone that has one
+    int moved = compact_zone(pool, target_rank, max_moves, move, arg);
+    for_each_region(pool, zone) {
+        if (moved >= 0) {
+            break;
+        }
+        moved = compact_zone(zone, target_rank, max_moves, move, arg);
+    }
+    return moved > 0 ? moved : 0;
+}
+
+int buddy_pool_return_bulk(buddy_pool_t *pool, void **pages, int n) {
+    if (n < 0 || (n > 0 && pages == NULL)) {
+        return -EINVAL;
+    }
+    sort_pages(pages, n);
+    if (zone_table(pool) == NULL) {
+        return zone_return_bulk(pool, pages, n);
+    }
+
+    // Zones do not overlap, so each one's pages are a run of the sorted
+    // batch
+    int ret = OK;
+    for (int i = 0; i < n;) {
+        buddy_pool_t *zone = zone_of(pool, pages[i]);
+        int j = i + 1;
+        while (j < n && zone_of(pool, pages[j]) == zone) {
+            j++;
+        }
+        if (zone_return_bulk(zone, pages + i, j - i) != OK) {
+            ret = -EINVAL;
+        }
+        i = j;
+    }
+    return ret;
+}
+
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p) {
+    pool = zone_of(pool, p);
+    int page_idx = get_page_index(pool, p);
+    if (page_idx < 0) {
+        return -EINVAL;
+    }
+
+    // Interior pages report the rank of their enclosing block
+    if (get_rank_byte(pool, page_idx) == 0) {
+        page_idx = find_block_head(pool, page_idx);
+        if (page_idx < 0) {
+            return -EINVAL;
+        }
+    }
+
+    // Return the stored rank (mask out the allocated and exact range bits)
+    int rank_byte = get_rank_byte(pool, page_idx);
+    int rank = rank_byte & RANK_MASK;
+    if (rank > 0 && rank <= MAXRANK) {
+        return rank;
+    }
+
+    return -EINVAL;
+}
+
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank) {
+    if (rank < 1 || rank > MAXRANK) {
+        return -EINVAL;
+    }
+
+    // Maintained by the free list helpers, so this never walks the list
+    int count = __atomic_load_n(&pool->area[rank].count, __ATOMIC_RELAXED);
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        count += __atomic_load_n(&zone->area[rank].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// Helper function to add one zone's counters to stats
+static void add_zone_stats(buddy_pool_t *pool, struct buddy_stats *stats) {
+    for (int s = 0; s < BUDDY_STAT_SLOTS; s++) {
+        struct buddy_stat_slot *slot = &pool->stats[s];
+        for (int r = 1; r <= MAXRANK; r++) {
+            stats->alloc[r] += __atomic_load_n(&slot->alloc[r], __ATOMIC_RELAXED);
+            stats->free[r] += __atomic_load_n(&slot->free[r], __ATOMIC_RELAXED);
+            stats->enospc[r] += __atomic_load_n(&slot->enospc[r], __ATOMIC_RELAXED);
+        }
+        stats->splits += __atomic_load_n(&slot->splits, __ATOMIC_RELAXED);
+        stats->merges += __atomic_load_n(&slot->merges, __ATOMIC_RELAXED);
+        stats->invalid_frees += __atomic_load_n(&slot->invalid_frees,
+                                                __ATOMIC_RELAXED);
+    }
+
+    unsigned int mask = __atomic_load_n(&pool->free_mask, __ATOMIC_RELAXED);
+    int largest = mask ? 31 - __builtin_clz(mask) : 0;
+    if (largest > stats->largest_free_rank) {
+        stats->largest_free_rank = largest;
+    }
+}
+
+int buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_stats *stats) {
+    if (pool == NULL || stats == NULL || !(pool->flags & BUDDY_POOL_STATS)) {
+        return -EINVAL;
+    }
+
+    __builtin_memset(stats, 0, sizeof(*stats));
+    add_zone_stats(pool, stats);
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        add_zone_stats(zone, stats);
+    }
+
+    unsigned long frees = 0;
+    for (int r = 1; r <= MAXRANK; r++) {
+        frees += stats->free[r];
+    }
+    stats->avg_merge_chain = frees ? (double)stats->merges / frees : 0.0;
+    return OK;
+}
+
+void buddy_pool_reset_stats(buddy_pool_t *pool) {
+    for (int s = 0; s < BUDDY_STAT_SLOTS; s++) {
+        __builtin_memset(&pool->stats[s], 0, sizeof(pool->stats[s]));
+    }
+
+    buddy_pool_t *zone;
+    for_each_region(pool, zone) {
+        buddy_pool_reset_stats(zone);
+    }
+}
+
+int buddy_pool_query_free(buddy_pool_t *pool, struct buddy_free_info *info) {
+    if (pool == NULL || info == NULL) {
+        return -EINVAL;
+    }
+
+    info->blocks[0] = 0;
+    info->free_pages = 0;
+    info->cold_pages = 0;
+    info->largest_free_rank = 0;
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        int count = __atomic_load_n(&pool->area[rank].count, __ATOMIC_RELAXED);
+        int cold = __atomic_load_n(&pool->area[rank].cold_count, __ATOMIC_RELAXED);
+        buddy_pool_t *zone;
+        for_each_region(pool, zone) {
+            count += __atomic_load_n(&zone->area[rank].count, __ATOMIC_RELAXED);
+            cold += __atomic_load_n(&zone->area[rank].cold_count, __ATOMIC_RELAXED);
+        }
+        info->blocks[rank] = count;
+        info->free_pages += (long)count << (rank - 1);
+        info->cold_pages += (long)cold << (rank - 1);
+        if (count > 0) {
+            info->largest_free_rank = rank;
+        }
+    }
+    return OK;
+}
+
+// Free pages in blocks of at least `rank`
+static long suitable_pages(const struct buddy_free_info *info, int rank) {
+    long pages = 0;
+    for (int r = rank; r <= MAXRANK; r++) {
+        pages += (long)info->blocks[r] << (r - 1);
+    }
+    return pages;
+}
+
+int buddy_unusable_index(const struct buddy_free_info *info, int rank) {
+    if (info == NULL || rank < 1 || rank > MAXRANK) {
+        return -EINVAL;
+    }
+    if (info->free_pages == 0) {
+        return 0;
+    }
+    long unusable = info->free_pages - suitable_pages(info, rank);
+    return (int)(unusable * 1000 / info->free_pages);
+}
+
+int buddy_fragmentation_index(const struct buddy_free_info *info, int rank) {
+    if (info == NULL || rank < 1 || rank > MAXRANK) {
+        return -EINVAL;
+    }
+    long free_blocks = 0;
+    for (int r = 1; r <= MAXRANK; r++) {
+        free_blocks += info->blocks[r];
+    }
+    if (free_blocks == 0) {
+        return 0;
+    }
+    if (suitable_pages(info, rank) > 0) {
+        return -1000;
+    }
+
+    // Few blocks holding many requests' worth of pages means fragmentation
+    long requested = 1L << (rank - 1);
+    return (int)(1000 - (1000 + info->free_pages * 1000 / requested) / free_blocks);
+}
+
+/*
+ * Consistency check and block walk
+ */
+
+// Helper function to check one list of free blocks of rank: links in
+// range and pointing back, every entry marked free at rank (cold or warm
+// as the list) and belonging on the list, and exactly `expect` entries
+static int check_free_list(buddy_pool_t *pool, struct buddy_free_area *area, int rank,
+                           int cold, int expect) {
+    int prev = -1;
+    int n = 0;
+    int cls;
+    for (int idx = cold ? area->cold_head : area->head; idx >= 0;
+         idx = block_links(pool, idx)->next) {
+        if (idx >= pool->total_pages || n++ == expect ||
+            (idx & ((1 << (rank - 1)) - 1)) != 0 ||
+            get_rank_byte(pool, idx) != (rank | (cold ? COLD_BIT : 0)) ||
+            free_area(pool, idx, rank, &cls) != area ||
+            block_links(pool, idx)->prev != prev) {
+            return -EINVAL;
+        }
+        prev = idx;
+    }
+    return n == expect ? OK : -EINVAL;
+}
+
+// Helper function to check the free bitmaps of an address-ordered pool's
+// rank: `free` blocks set in the bottom level, and each bit above set
+// exactly when its word below is non-zero
+static int check_bitmaps(buddy_pool_t *pool, int rank, int free) {
+    unsigned long *words = bitmap_words(pool);
+    const int *level = pool->free_bitmap[rank];
+    int nbits = pool->total_pages >> (rank - 1);
+    int set = 0;
+    for (int w = 0; level[0] >= 0 && w < (nbits + 63) / 64; w++) {
+        set += __builtin_popcountl(words[level[0] + w]);
+    }
+    if (set != free) {
+        return -EINVAL;
+    }
+    for (int l = 1; l < BUDDY_BITMAP_LEVELS && level[l] >= 0; l++) {
+        nbits = (nbits + 63) / 64;
+        for (int w = 0; w < nbits; w++) {
+            int bit = (words[level[l] + w / 64] >> (w % 64)) & 1;
+            if (bit != (words[level[l - 1] + w] != 0)) {
+                return -EINVAL;
+            }
+        }
+    }
+    return OK;
+}
+
+// Helper function behind buddy_pool_check() for one zone
+static int check_zone(buddy_pool_t *pool) {
+    // Free blocks per list: the shared ones first, then each class's
+    int warm[1 + BUDDY_CLASSES][MAXRANK + 1] = {{0}};
+    int cold[1 + BUDDY_CLASSES][MAXRANK + 1] = {{0}};
+    int order = has_bitmaps(pool->flags);
+    if (pool->pageblock_rank > 0) {
+        int pageblocks = (pool->total_pages + (1 << (pool->pageblock_rank - 1)) - 1) >>
+                         (pool->pageblock_rank - 1);
+        for (int pb = 0; pb < pageblocks; pb++) {
+            if (block_classes(pool)[pb] >= BUDDY_CLASSES) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    // Walk the blocks by their head marks: every head is aligned to its
+    // rank, fits in the pool and has no marks inside it, so the blocks
+    // tile the pool exactly
+    int exact_rank = 0;  // Rank of the previous exact piece, 0 if none
+    for (int idx = 0; idx < pool->total_pages;) {
+        int byte = get_rank_byte(pool, idx);
+        int rank = byte & RANK_MASK;
+        int size = 1 << (rank - 1);
+        if (rank == 0 || rank > MAXRANK || (idx & (size - 1)) != 0 ||
+            size > pool->total_pages - idx) {
+            return -EINVAL;
+        }
+        for (int i = 1; i < size; i++) {
+            if (get_rank_byte(pool, idx + i) != 0) {
+                return -EINVAL;
+            }
+        }
+
+        int flags = byte & ~RANK_MASK;
+        if (!(byte & ALLOCATED_BIT)) {
+            if (flags & ~COLD_BIT) {
+                return -EINVAL;
+            }
+            // Eager pools merge every pair of free buddies
+            int buddy = get_buddy_index(idx, rank);
+            if (pool->lazy_limit == 0 && rank < MAXRANK && buddy < pool->total_pages &&
+                is_free_block(pool, buddy, rank)) {
+                return -EINVAL;
+            }
+            if (order &&
+                !((bitmap_words(pool)[pool->free_bitmap[rank][0] +
+                                      (idx >> (rank - 1)) / 64] >>
+                   ((idx >> (rank - 1)) % 64)) & 1)) {
+                return -EINVAL;
+            }
+            int cls;
+            free_area(pool, idx, rank, &cls);
+            if (byte & COLD_BIT) {
+                cold[cls + 1][rank]++;
+            } else {
+                warm[cls + 1][rank]++;
+            }
+        } else if (flags == (ALLOCATED_BIT | CACHED_BIT)) {
+            // Held by a pcp, or queued by a deferred free
+        } else if (flags == (ALLOCATED_BIT | EXACT_BIT | TAIL_BIT)) {
+            // Pieces after the first of a range shrink and follow it
+            if (exact_rank <= rank) {
+                return -EINVAL;
+            }
+        } else if (flags != ALLOCATED_BIT && flags != (ALLOCATED_BIT | EXACT_BIT)) {
+            return -EINVAL;
+        }
+        exact_rank = (byte & EXACT_BIT) ? rank : 0;
+        idx += size;
+    }
+
+    // The lists, counts, masks and bitmaps must agree with the marks. The
+    // shared list's counts are the totals of all the rank's lists.
+    unsigned int mask = 0;
+    unsigned int class_mask[BUDDY_CLASSES] = {0};
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        struct buddy_free_area *lists[1 + BUDDY_CLASSES];
+        int n = rank_lists(pool, rank, lists);
+        int total = 0, total_cold = 0;
+        for (int l = 0; l < 1 + BUDDY_CLASSES; l++) {
+            if (l >= n && warm[l][rank] + cold[l][rank] > 0) {
+                return -EINVAL;
+            }
+            total += warm[l][rank] + cold[l][rank];
+            total_cold += cold[l][rank];
+        }
+        for (int l = 0; l < n; l++) {
+            struct buddy_free_area *area = lists[l];
+            if ((l > 0 && (area->count != warm[l][rank] + cold[l][rank] ||
+                           area->cold_count != cold[l][rank])) ||
+                area->pending < 0 ||
+                check_free_list(pool, area, rank, 0, warm[l][rank]) != OK ||
+                check_free_list(pool, area, rank, 1, cold[l][rank]) != OK) {
+                return -EINVAL;
+            }
+            if (l > 0 && area->count > 0) {
+                class_mask[l - 1] |= 1u << rank;
+            }
+        }
+        struct buddy_free_area *area = &pool->area[rank];
+        if (area->count != total || area->cold_count != total_cold ||
+            (order && check_bitmaps(pool, rank, area->count) != OK)) {
+            return -EINVAL;
+        }
+        if (area->count > 0) {
+            mask |= 1u << rank;
+        }
+    }
+    for (int c = 0; c < BUDDY_CLASSES; c++) {
+        if (class_mask[c] != pool->class_mask[c]) {
+            return -EINVAL;
+        }
+    }
+    return mask == pool->free_mask ? OK : -EINVAL;
+}
+
+int buddy_pool_check(buddy_pool_t *pool) {
+    if (pool == NULL || check_zone(pool) != OK) {
+        return -EINVAL;
+    }
+
+    // Zones must be sorted, apart and consistent themselves
+    struct buddy_zone_table *table = zone_table(pool);
+    for (int z = 0; table != NULL && z < table->nzones; z++) {
+        buddy_pool_t *zone = table->zone[z];
+        if ((zone != pool && check_zone(zone) != OK) ||
+            (z > 0 && pool_memory(table->zone[z - 1]) +
+                              (long)table->zone[z - 1]->total_pages * PAGE_SIZE >
+                          pool_memory(zone))) {
+            return -EINVAL;
+        }
+    }
+    return OK;
+}
+
+// Helper function behind buddy_pool_walk() for one zone
+static int walk_zone(buddy_pool_t *pool, buddy_walk_fn fn, void *arg) {
+    for (int idx = 0; idx < pool->total_pages;) {
+        int byte = get_rank_byte(pool, idx);
+        int rank = byte & RANK_MASK;
+        if (rank == 0 || rank > MAXRANK || (idx & ((1 << (rank - 1)) - 1)) != 0) {
+            // Changing under a concurrent call; resync on the next head
+            idx++;
+            continue;
+        }
+
+        int state = 0;
+        if (byte & ALLOCATED_BIT) {
+            state = BUDDY_BLOCK_ALLOCATED;
+            if (byte & EXACT_BIT) {
+                state |= BUDDY_BLOCK_EXACT;
+            } else if (byte & CACHED_BIT) {
+                state |= BUDDY_BLOCK_CACHED;
+            }
+        } else if (byte & COLD_BIT) {
+            state = BUDDY_BLOCK_COLD;
+        }
+        int ret = fn(page_addr(pool, idx), rank, state, arg);
+        if (ret != 0) {
+            return ret;
+        }
+        idx += 1 << (rank - 1);
+    }
+    return 0;
+}
+
+int buddy_pool_walk(buddy_pool_t *pool, buddy_walk_fn fn, void *arg) {
+    if (pool == NULL || fn == NULL) {
+        return -EINVAL;
+    }
+
+    struct buddy_zone_table *table = zone_table(pool);
+    if (table == NULL) {
+        return walk_zone(pool, fn, arg);
+    }
+    for (int z = 0; z < table->nzones; z++) {
+        int ret = walk_zone(table->zone[z], fn, arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Snapshots
+ */
+
+// Metadata images start on a cache line after the header
+#define SNAPSHOT_META_OFFSET \
+    ((sizeof(struct buddy_snapshot) + 63) & ~(unsigned long)63)
+
+// Helper function to size the metadata image of a pool: page_rank, and
+// the side tables from the next word on, whose offset goes to *tables
+static unsigned long image_size(int pgcount, int flags, unsigned long *tables) {
+    unsigned long size = buddy_meta_size_ex(pgcount, flags);
+    *tables = (unsigned long)pgcount;
+    if (size > (unsigned long)pgcount) {
+        // buddy_meta_size_ex() counts the worst-case alignment instead
+        *tables = ((unsigned long)pgcount + sizeof(unsigned long) - 1) &
+                  ~(sizeof(unsigned long) - 1);
+        size += *tables - pgcount - (sizeof(unsigned long) - 1);
+    }
+    return size;
+}
+
+static void save_area(struct buddy_snapshot_area *to, const struct buddy_free_area *from) {
+    to->head = from->head;
+    to->count = from->count;
+    to->pending = from->pending;
+    to->cold_head = from->cold_head;
+    to->cold_count = from->cold_count;
+}
+
+// Helper function to restore a free area; fails for an out of range one
+static int valid_area(const struct buddy_snapshot_area *from, int pgcount) {
+    return from->head >= -1 && from->head < pgcount && from->cold_head >= -1 &&
+           from->cold_head < pgcount && from->count >= 0 && from->cold_count >= 0 &&
+           from->pending >= 0;
+}
+
+static void load_area(struct buddy_free_area *to, const struct buddy_snapshot_area *from) {
+    to->head = from->head;
+    to->count = from->count;
+    to->lock = 0;
+    to->pending = from->pending;
+    to->cold_head = from->cold_head;
+    to->cold_count = from->cold_count;
+}
+
+unsigned long buddy_pool_snapshot_size(buddy_pool_t *pool) {
+    if (pool == NULL || zone_table(pool) != NULL) {
+        return 0;
+    }
+    unsigned long tables;
+    return SNAPSHOT_META_OFFSET + image_size(pool->total_pages, pool->flags, &tables);
+}
+
+int buddy_pool_snapshot(buddy_pool_t *pool, void *buf, unsigned long len) {
+    if (pool == NULL || buf == NULL || zone_table(pool) != NULL) {
+        return -EINVAL;
+    }
+    int pgcount = pool->total_pages;
+    unsigned long tables;
+    unsigned long meta_size = image_size(pgcount, pool->flags, &tables);
+    if (len < SNAPSHOT_META_OFFSET + meta_size) {
+        return -ENOSPC;
+    }
+    if (pool->flags & BUDDY_POOL_DEFERRED) {
+        drain_zone(pool);
+    }
+
+    struct buddy_snapshot *snap = buf;
+    __builtin_memcpy(snap->magic, BUDDY_SNAPSHOT_MAGIC, sizeof(snap->magic));
+    snap->version = BUDDY_SNAPSHOT_VERSION;
+    snap->header_size = sizeof(*snap);
+    snap->page_shift = BUDDY_PAGE_SHIFT;
+    snap->maxrank = MAXRANK;
+    snap->flags = pool->flags;
+    snap->total_pages = pgcount;
+    snap->lazy_limit = pool->lazy_limit;
+    snap->free_mask = pool->free_mask;
+    snap->meta_offset = SNAPSHOT_META_OFFSET;
+    snap->meta_size = meta_size;
+    for (int rank = 0; rank <= MAXRANK; rank++) {
+        save_area(&snap->area[rank], &pool->area[rank]);
+    }
+    for (int c = 0; c < BUDDY_CLASSES; c++) {
+        snap->class_mask[c] = pool->class_mask[c];
+        for (int rank = 0; rank < MAXRANK; rank++) {
+            save_area(&snap->class_area[c][rank], &pool->class_area[c][rank]);
+        }
+    }
+
+    // A pool restored in place already keeps its metadata in the image
+    char *image = (char *)buf + SNAPSHOT_META_OFFSET;
+    unsigned char *page_rank = page_ranks(pool);
+    if (image != (char *)page_rank) {
+        char *start = (char *)(((unsigned long)(page_rank + pgcount) +
+                                sizeof(unsigned long) - 1) &
+                               ~(sizeof(unsigned long) - 1));
+        __builtin_memcpy(image, page_rank, (unsigned long)pgcount);
+        __builtin_memset(image + pgcount, 0, tables - pgcount);
+        __builtin_memcpy(image + tables, start, meta_size - tables);
+    }
+    return OK;
+}
+
+int buddy_pool_restore(buddy_pool_t *pool, void *p, void *snapshot, unsigned long len,
+                       void *meta) {
+    struct buddy_snapshot *snap = snapshot;
+    // The restored pool is not in a shared segment, whatever it was in
+    int flags = snap == NULL ? 0 : snap->flags & ~BUDDY_POOL_SHARED;
+    if (pool == NULL || p == NULL || snap == NULL || len < sizeof(*snap) ||
+        __builtin_memcmp(snap->magic, BUDDY_SNAPSHOT_MAGIC, sizeof(snap->magic)) != 0 ||
+        snap->version != BUDDY_SNAPSHOT_VERSION || snap->header_size != sizeof(*snap) ||
+        snap->page_shift != BUDDY_PAGE_SHIFT || snap->maxrank != MAXRANK ||
+        !valid_flags(flags) || snap->total_pages <= 0) {
+        return -EINVAL;
+    }
+    int pgcount = snap->total_pages;
+    unsigned long tables;
+    unsigned long meta_size = image_size(pgcount, flags, &tables);
+    char *image = (char *)snapshot + SNAPSHOT_META_OFFSET;
+    if (snap->meta_offset != SNAPSHOT_META_OFFSET || snap->meta_size != meta_size ||
+        len < SNAPSHOT_META_OFFSET + meta_size ||
+        // In place, the tables must line up with the image's
+        (meta == NULL && (unsigned long)image % sizeof(unsigned long) != 0)) {
+        return -EINVAL;
+    }
+    // Every list is checked before any is loaded, so a failed restore
+    // leaves the pool as it was
+    for (int rank = 0; rank <= MAXRANK; rank++) {
+        if (!valid_area(&snap->area[rank], pgcount)) {
+            return -EINVAL;
+        }
+    }
+    for (int c = 0; c < BUDDY_CLASSES; c++) {
+        for (int rank = 0; rank < MAXRANK; rank++) {
+            if (!valid_area(&snap->class_area[c][rank], pgcount)) {
+                return -EINVAL;
+            }
+        }
+    }
+
+    for (int rank = 0; rank <= MAXRANK; rank++) {
+        load_area(&pool->area[rank], &snap->area[rank]);
+    }
+    for (int c = 0; c < BUDDY_CLASSES; c++) {
+        for (int rank = 0; rank < MAXRANK; rank++) {
+            load_area(&pool->class_area[c][rank], &snap->class_area[c][rank]);
+        }
+        pool->class_mask[c] = snap->class_mask[c];
+    }
+
+    pool->flags = flags;
+    pool->memory_start = pool_offset(pool, p);
+    pool->total_pages = pgcount;
+    char *start = setup_meta(pool, pgcount, meta != NULL ? meta : image, flags);
+    if (meta != NULL) {
+        __builtin_memcpy(meta, image, (unsigned long)pgcount);
+        __builtin_memcpy(start, image + tables, meta_size - tables);
+    }
+    pool->lazy_limit = snap->lazy_limit;
+    pool->free_mask = snap->free_mask;
+    pool->zones = NULL;
+    pool->zone_lock = 0;
+    pool->compact_cursor = 0;
+    for (int i = 0; i < BUDDY_COMPACT_PINNED; i++) {
+        pool->compact_pinned[i] = -1;
+    }
+    pool->compact_pinned_next = 0;
+    pool->deferred_head = -1;
+    pool->drain_lock = 0;
+    __builtin_memset(pool->stats, 0, sizeof(pool->stats));
+    return OK;
+}
+
+/*
+ * Shared pools
+ */
+
+// Bytes in front of a shared pool's pages, holding the pool itself
+#define SHARED_HEADER_SIZE ((sizeof(buddy_pool_t) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+unsigned long buddy_shared_size(int pgcount, int flags) {
+    if (pgcount <= 0) {
+        return 0;
+    }
+    return SHARED_HEADER_SIZE + ((unsigned long)pgcount << PAGE_SHIFT) +
+           buddy_meta_size_ex(pgcount, flags);
+}
+
+buddy_pool_t *buddy_pool_create_shared(void *segment, int pgcount, int flags) {
+    if (segment == NULL || (unsigned long)segment % PAGE_SIZE != 0 || pgcount <= 0) {
+        return ERR_PTR(-EINVAL);
+    }
+    buddy_pool_t *pool = segment;
+    char *memory = (char *)segment + SHARED_HEADER_SIZE;
+    int ret = buddy_pool_init_ex(pool, memory, pgcount,
+                                 memory + ((unsigned long)pgcount << PAGE_SHIFT),
+                                 flags | BUDDY_POOL_THREADSAFE);
+    if (ret != OK) {
+        return ERR_PTR(ret);
+    }
+    // Attaching processes look for the flag, so it is published last
+    __atomic_store_n(&pool->flags, pool->flags | BUDDY_POOL_SHARED, __ATOMIC_RELEASE);
+    return pool;
+}
+
+buddy_pool_t *buddy_pool_attach_shared(void *segment) {
+    buddy_pool_t *pool = segment;
+    if (segment == NULL || (unsigned long)segment % PAGE_SIZE != 0 ||
+        !(__atomic_load_n(&pool->flags, __ATOMIC_ACQUIRE) & BUDDY_POOL_SHARED) ||
+        pool->memory_start != (long)SHARED_HEADER_SIZE) {
+        return ERR_PTR(-EINVAL);
+    }
+    return pool;
+}
+
+/*
+ * Per-thread page caches
+ */
+
+int buddy_pcp_init(buddy_pcp_t *pcp, buddy_pool_t *pool, int low, int high) {
+    if (pcp == NULL || pool == NULL || low < 0 || high <= low ||
+        high > BUDDY_PCP_MAX) {
+        return -EINVAL;
+    }
+    pcp->pool = pool;
+    pcp->low = low;
+    pcp->high = high;
+    for (int i = 0; i < BUDDY_PCP_MAXRANK; i++) {
+        pcp->count[i] = 0;
+    }
+    return OK;
+}
+
+// Helper function to release cached blocks of one rank until `keep` remain.
+// The oldest entries go back first so recently freed pages stay cached.
+static void pcp_drain_rank(buddy_pcp_t *pcp, int rank, int keep) {
+    int *pages = pcp->pages[rank - 1];
+    int excess = pcp->count[rank - 1] - keep;
+    if (excess <= 0) {
+        return;
+    }
+    void *batch[BUDDY_PCP_MAX];
+    for (int i = 0; i < excess; i++) {
+        set_rank_byte(pcp->pool, pages[i], rank | ALLOCATED_BIT);
+        batch[i] = page_addr(pcp->pool, pages[i]);
+    }
+    buddy_pool_return_bulk(pcp->pool, batch, excess);
+    for (int i = 0; i < keep; i++) {
+        pages[i] = pages[excess + i];
+    }
+    pcp->count[rank - 1] = keep;
+}
+
+void *buddy_pcp_alloc(buddy_pcp_t *pcp, int rank) {
+    if (rank < 1 || rank > BUDDY_PCP_MAXRANK) {
+        return buddy_pool_alloc(pcp->pool, rank);
+    }
+
+    int *count = &pcp->count[rank - 1];
+    int *pages = pcp->pages[rank - 1];
+    if (*count == 0) {
+        // Refill in one batch; a partial refill still serves this request.
+        // Only the pool's own zone is cached, the other zones serve the
+        // request uncached once it is empty.
+        void *batch[BUDDY_PCP_MAX];
+        int got = zone_alloc_bulk(pcp->pool, rank, pcp->low > 0 ? pcp->low : 1,
+                                  batch);
+        if (got == 0) {
+            return buddy_pool_alloc(pcp->pool, rank);
+        }
+        // Hand out the lowest block first
+        for (int i = got - 1; i >= 0; i--) {
+            int page_idx = get_page_index(pcp->pool, batch[i]);
+            set_rank_byte(pcp->pool, page_idx, rank | ALLOCATED_BIT | CACHED_BIT);
+            pages[(*count)++] = page_idx;
+        }
+    }
+    int page_idx = pages[--(*count)];
+    set_rank_byte(pcp->pool, page_idx, rank | ALLOCATED_BIT);
+    return page_addr(pcp->pool, page_idx);
+}
+
+int buddy_pcp_return(buddy_pcp_t *pcp, void *p) {
+    buddy_pool_t *pool = pcp->pool;
+    int page_idx = p == NULL ? -1 : get_page_index(pool, p);
+    if (page_idx < 0) {
+        return buddy_pool_return(pool, p);  // Another zone, or invalid
+    }
+
+    int rank_byte = get_rank_byte(pool, page_idx);
+    int rank = rank_byte & RANK_MASK;
+    if ((rank_byte & (ALLOCATED_BIT | EXACT_BIT | CACHED_BIT)) != ALLOCATED_BIT ||
+        rank > BUDDY_PCP_MAXRANK) {
+        return buddy_pool_return(pool, p);
+    }
+    // Cached blocks are marked, so compaction leaves them where they are
+    // and a second return is rejected; hardened pools claim them atomically
+    if (!claim_block(pool, page_idx, rank_byte, rank_byte | CACHED_BIT)) {
+        STAT_ADD(pool, invalid_frees, 1);
+        return -EINVAL;
+    }
+
+    if (pcp->count[rank - 1] == pcp->high) {
+        pcp_drain_rank(pcp, rank, pcp->low);
+    }
+    pcp->pages[rank - 1][pcp->count[rank - 1]++] = page_idx;
+    return OK;
+}
+
+void buddy_pcp_drain(buddy_pcp_t *pcp) {
+    for (int r = 1; r <= BUDDY_PCP_MAXRANK; r++) {
+        pcp_drain_rank(pcp, r, 0);
+    }
+}
+
+/*
+ * Single-pool interface, backed by default_pool
+ */
+
+buddy_pool_t *buddy_default_pool(void) {
+    return &default_pool;
+}
+
+int init_page(void *p, int pgcount) {
+    if (pgcount <= DEFAULT_META_PAGES &&
+        buddy_meta_size_ex(pgcount, DEFAULT_FLAGS) <= sizeof(default_meta)) {
+        return buddy_pool_init_ex(&default_pool, p, pgcount, default_meta, DEFAULT_FLAGS);
+    }
+    return buddy_pool_init_ex(&default_pool, p, pgcount, NULL, DEFAULT_FLAGS);
+}
+
+int init_page_meta(void *p, int pgcount, void *meta) {
+    return buddy_pool_init_meta(&default_pool, p, pgcount, meta);
+}
+
+void *alloc_pages(int rank) {
+    return buddy_pool_alloc(&default_pool, rank);
+}
+
+void *alloc_pages_class(int rank, int cls) {
+    return buddy_pool_alloc_class(&default_pool, rank, cls);
+}
+
+int return_pages(void *p) {
+    return buddy_pool_return(&default_pool, p);
+}
+
+int query_ranks(void *p) {
+    return buddy_pool_query_ranks(&default_pool, p);
+}
+
+int query_page_counts(int rank) {
+    return buddy_pool_query_page_counts(&default_pool, rank);
+}
+
+int alloc_pages_bulk(int rank, int n, void **out) {
+    return buddy_pool_alloc_bulk(&default_pool, rank, n, out);
+}
+
+int return_pages_bulk(void **pages, int n) {
+    return buddy_pool_return_bulk(&default_pool, pages, n);
+}
+
+void *alloc_pages_exact(int npages) {
+    return buddy_pool_alloc_exact(&default_pool, npages);
+}
+
+int return_pages_exact(void *p, int npages) {
+    return buddy_pool_return_exact(&default_pool, p, npages);
+}
+
+void *realloc_pages(void *p, int new_rank) {
+    return buddy_pool_realloc(&default_pool, p, new_rank);
+}
+
+int buddy_add_region(void *p, int pgcount) {
+    return buddy_pool_add_region(&default_pool, p, pgcount);
+}
+
+int buddy_compact(int target_rank, int max_moves, buddy_move_fn move, void *arg) {
+    return buddy_pool_compact(&default_pool, target_rank, max_moves, move, arg);
+}
+
+void *alloc_pages_constrained(int rank, int min_align_rank, unsigned long lo_addr,
+                              unsigned long hi_addr) {
+    return buddy_pool_alloc_constrained(&default_pool, rank, min_align_rank,
+                                        lo_addr, hi_addr);
+}
+
+int buddy_check(void) {
+    return buddy_pool_check(&default_pool);
+}
+
+int buddy_walk(buddy_walk_fn fn, void *arg) {
+    return buddy_pool_walk(&default_pool, fn, arg);
+}
+
+unsigned long buddy_snapshot_size(void) {
+    return buddy_pool_snapshot_size(&default_pool);
+}
+
+int buddy_snapshot(void *buf, unsigned long len) {
+    return buddy_pool_snapshot(&default_pool, buf, len);
+}
+
+int buddy_restore(void *p, void *snapshot, unsigned long len, void *meta) {
+    return buddy_pool_restore(&default_pool, p, snapshot, len, meta);
 }
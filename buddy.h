@@ -6,6 +6,22 @@
 #define EINVAL      22  /* Invalid argument */    
 #define ENOSPC      28  /* No page left */  
 
+/*
+ * Pool geometry, fixed at compile time so page arithmetic folds into
+ * shifts and masks: pages are 2^BUDDY_PAGE_SHIFT bytes and blocks of the
+ * largest rank BUDDY_MAXRANK hold 2^(BUDDY_MAXRANK-1) pages. Override
+ * both with -D for every file of a program, e.g. -DBUDDY_PAGE_SHIFT=16
+ * for 64 KiB pages or -DBUDDY_MAXRANK=20 for 2 GiB blocks of 4 KiB pages.
+ * 4 <= BUDDY_PAGE_SHIFT and 1 <= BUDDY_MAXRANK <= 31.
+ */
+#ifndef BUDDY_PAGE_SHIFT
+#define BUDDY_PAGE_SHIFT 12
+#endif
+#define BUDDY_PAGE_SIZE (1UL << BUDDY_PAGE_SHIFT)
+#ifndef BUDDY_MAXRANK
+#define BUDDY_MAXRANK 16
+#endif
+
 
 #define IS_ERR_VALUE(x) ((x) >= (unsigned long)-MAX_ERRNO)
 static inline void *ERR_PTR(long error) { return (void *)error; }
@@ -14,9 +30,536 @@ static inline long IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)
 
 
 int init_page(void *p, int pgcount);
+
+/*
+ * Metadata needed to manage pgcount pages (one byte per page). init_page()
+ * makes a pool with BUDDY_POOL_ADDRESS_INDEX; it uses built-in storage
+ * for up to 65536 pages and carves larger pools' metadata from their last
+ * pages. init_page_meta() makes a pool without it and takes the region
+ * explicitly: meta must hold buddy_meta_size(pgcount) bytes outside the
+ * pool, or be NULL to carve it from the end of the pool.
+ * buddy_meta_size_ex() is the size for a pool with BUDDY_POOL_* flags.
+ */
+unsigned long buddy_meta_size(int pgcount);
+unsigned long buddy_meta_size_ex(int pgcount, int flags);
+int init_page_meta(void *p, int pgcount, void *meta);
+
+/*
+ * Independent buddy pool. The functions above operate on a built-in
+ * default instance; buddy_pool_*() take the instance explicitly and
+ * behave the same way. buddy_pool_init() carves the metadata from the
+ * end of the pool, buddy_pool_init_meta() follows init_page_meta().
+ * buddy_pool_init_ex() additionally takes BUDDY_POOL_* flags:
+ *
+ * BUDDY_POOL_THREADSAFE  the pool may be used from several threads at
+ *                        once. Each rank's free list has its own lock;
+ *                        there is no pool-wide lock. Under contention
+ *                        -ENOSPC may be returned while blocks are being
+ *                        merged by another thread.
+ * BUDDY_POOL_STATS       keep the counters read by buddy_pool_get_stats().
+ * BUDDY_POOL_ADDRESS_ORDERED
+ *                        allocate the lowest-addressed free block of the
+ *                        smallest rank that fits instead of the most
+ *                        recently freed one, which keeps live blocks
+ *                        packed at the start of the pool. Needs
+ *                        buddy_meta_size_ex() bytes of metadata for the
+ *                        per-rank free bitmaps.
+ * BUDDY_POOL_ADDRESS_INDEX
+ *                        keep the free bitmaps of BUDDY_POOL_ADDRESS_ORDERED
+ *                        without changing which block an allocation takes.
+ *                        buddy_pool_alloc_constrained() and
+ *                        buddy_pool_compact() need one of the two flags to
+ *                        find free blocks by address. Same metadata as
+ *                        BUDDY_POOL_ADDRESS_ORDERED, and unlike it may be
+ *                        combined with BUDDY_POOL_PAGEBLOCK().
+ * BUDDY_POOL_OFFPAGE     keep the free lists in the metadata (8 bytes per
+ *                        page, see buddy_meta_size_ex()) rather than in
+ *                        the free pages, so the allocator never reads or
+ *                        writes managed memory and free pages can stay
+ *                        cold or unmapped.
+ * BUDDY_POOL_HARDENED    catch misuse that the O(1) head-mark checks
+ *                        alone cannot: a block freed by two threads at
+ *                        once, directly or through per-thread caches, is
+ *                        claimed atomically by one of them, and the
+ *                        free-list neighbours of a block are checked
+ *                        before its links are used, trapping if a write
+ *                        after free corrupted them.
+ *                        Costs an atomic per free and a few loads per
+ *                        list operation, so it can stay on in production.
+ * BUDDY_POOL_DEFERRED   buddy_pool_return() only checks the block and
+ *                        queues it on a lock-free list of its zone, so
+ *                        that merging stays off the caller's path; see
+ *                        buddy_pool_drain().
+ * BUDDY_POOL_PAGEBLOCK(rank)
+ *                        group blocks below rank by allocation class
+ *                        into pageblocks of that rank, 2 <= rank <=
+ *                        BUDDY_MAXRANK; see buddy_pool_alloc_class().
+ *                        Needs buddy_meta_size_ex() bytes of metadata
+ *                        (another byte per page, and one per pageblock).
+ *                        Cannot be combined with
+ *                        BUDDY_POOL_ADDRESS_ORDERED.
+ * BUDDY_POOL_SHARED      set on pools made by buddy_pool_create_shared();
+ *                        not accepted by buddy_pool_init_ex().
+ *
+ * Any pool rejects frees of interior pages, of free blocks and of
+ * pointers outside the pool with -EINVAL in constant time, and counts
+ * them in buddy_stats.invalid_frees. A block freed twice is only caught
+ * while it has not been allocated again.
+ *
+ * Fields are private to buddy.c. A pool holds no pointers to its own
+ * memory, so it must not be copied: a copy would resolve them from its
+ * own address.
+ */
+#define BUDDY_POOL_THREADSAFE 0x1
+#define BUDDY_POOL_STATS      0x2
+#define BUDDY_POOL_ADDRESS_ORDERED 0x4
+#define BUDDY_POOL_OFFPAGE    0x8
+#define BUDDY_POOL_HARDENED   0x10
+#define BUDDY_POOL_DEFERRED   0x20
+#define BUDDY_POOL_SHARED     0x40
+#define BUDDY_POOL_ADDRESS_INDEX 0x80
+#define BUDDY_POOL_PAGEBLOCK(rank) ((rank) << 8)
+
+/* Allocation classes, see buddy_pool_alloc_class() */
+#define BUDDY_CLASS_UNMOVABLE   0
+#define BUDDY_CLASS_RECLAIMABLE 1
+#define BUDDY_CLASS_MOVABLE     2
+#define BUDDY_CLASSES           3
+
+/* Levels of a per-rank free bitmap; enough for 2^31 blocks */
+#define BUDDY_BITMAP_LEVELS 6
+
+/* Blocks compaction failed to move, remembered so it passes them over */
+#define BUDDY_COMPACT_PINNED 8
+
+/* Counter slots; threads are spread over them and readers sum them up */
+#define BUDDY_STAT_SLOTS 16
+
+struct buddy_stat_slot {
+    unsigned long alloc[BUDDY_MAXRANK + 1];
+    unsigned long free[BUDDY_MAXRANK + 1];
+    unsigned long enospc[BUDDY_MAXRANK + 1];
+    unsigned long splits;
+    unsigned long merges;
+    unsigned long invalid_frees;
+} __attribute__((aligned(64)));
+
+struct buddy_free_area {
+    int head;                                 /* page index, -1 if empty */
+    int count;
+    int lock;
+    int pending;                              /* blocks pushed, not coalesced */
+    int cold_head;                            /* decommitted blocks, -1 if none */
+    int cold_count;
+} __attribute__((aligned(64)));
+
+typedef struct buddy_pool {
+    unsigned int free_mask;                   /* bit r: area[r] non-empty */
+    int flags;
+    /* The pool's memory and metadata tables are given as offsets from the
+       pool itself rather than pointers, 0 for a table its flags do not
+       use, so that a pool in shared memory works wherever it is mapped */
+    long memory_start;
+    int total_pages;
+    long page_rank;
+    long free_links;                          /* BUDDY_POOL_OFFPAGE only */
+    int lazy_limit;
+    struct buddy_zone_table *zones;           /* NULL until a region is added */
+    int zone_lock;
+    int compact_cursor;                       /* where compaction scans next */
+    int compact_pinned[BUDDY_COMPACT_PINNED]; /* page indices, -1 if unused */
+    unsigned int compact_pinned_next;         /* slot the next one goes in */
+    /* BUDDY_POOL_DEFERRED: queued frees, -1 if none; pushed by every
+       freeing thread, so on a line of its own */
+    int deferred_head __attribute__((aligned(64)));
+    int drain_lock;                           /* held while freeing the queue */
+    struct buddy_free_area area[BUDDY_MAXRANK + 1];    /* counts cover all lists */
+    int pageblock_rank;                       /* 0 unless grouping by class */
+    long block_class;                         /* class of each pageblock */
+    long page_class;                          /* class of each allocated head */
+    unsigned int class_mask[BUDDY_CLASSES];   /* bit r: class_area[c][r] non-empty */
+    /* free lists of the ranks below pageblock_rank, one per class, under
+       the lock of area[r] */
+    struct buddy_free_area class_area[BUDDY_CLASSES][BUDDY_MAXRANK];
+    /* address-ordered pools: bit per block of the rank, set while free;
+       each level above has a bit per non-zero word below. Levels are
+       indices into the words, -1 past the top level. */
+    long free_bitmap_words;
+    int free_bitmap[BUDDY_MAXRANK + 1][BUDDY_BITMAP_LEVELS];
+    struct buddy_stat_slot stats[BUDDY_STAT_SLOTS];
+} __attribute__((aligned(64))) buddy_pool_t;
+
+int buddy_pool_init(buddy_pool_t *pool, void *p, int pgcount);
+int buddy_pool_init_meta(buddy_pool_t *pool, void *p, int pgcount, void *meta);
+int buddy_pool_init_ex(buddy_pool_t *pool, void *p, int pgcount, void *meta,
+                       int flags);
+void *buddy_pool_alloc(buddy_pool_t *pool, int rank);
+int buddy_pool_return(buddy_pool_t *pool, void *p);
+/*
+ * Allocate a block tagged with a BUDDY_CLASS_* allocation class, after
+ * Linux's migrate types: UNMOVABLE for pinned memory, RECLAIMABLE for
+ * caches that can be dropped, MOVABLE for data the caller can migrate.
+ * In a pool grouped with BUDDY_POOL_PAGEBLOCK() every pageblock belongs
+ * to one class, and a request below the pageblock rank is served from
+ * its own class's pageblocks first, then by splitting a free pageblock or
+ * larger block, which joins the class, and only then by stealing the
+ * largest free block of another class's pageblock. A steal of at least
+ * the square root of a pageblock's pages, or any steal for an unmovable
+ * or reclaimable request, also moves the pageblock and its free blocks
+ * to the class if at least half of it is free or already allocated to
+ * the class. Requests of the pageblock rank or more
+ * take whole pageblocks and ignore the class, as do constrained
+ * allocations; every other allocation call is UNMOVABLE. Pools without
+ * grouping ignore the class. Returns -EINVAL for a bad class, otherwise
+ * as buddy_pool_alloc().
+ */
+void *buddy_pool_alloc_class(buddy_pool_t *pool, int rank, int cls);
+/*
+ * Grow a pool by pgcount page-aligned pages at p, which must not overlap
+ * it. The region becomes a zone of its own, so blocks never span regions;
+ * its last pages hold the zone's bookkeeping and metadata. Allocations
+ * try the pool's own pages first and then each region in address order,
+ * returns find the owning zone with a binary search, and the query, stats
+ * and tuning calls cover every zone. Regions can be added while the pool
+ * is in use but never removed. Returns -EINVAL for a bad or overlapping
+ * region or one too small to hold its bookkeeping.
+ */
+int buddy_pool_add_region(buddy_pool_t *pool, void *p, int pgcount);
+/*
+ * Lazy coalescing. With a limit > 0, returned blocks go onto their rank's
+ * free list unmerged; a rank is coalesced once more than `limit` blocks
+ * were pushed onto it since it was last coalesced, and all ranks are
+ * coalesced before an allocation would fail. Free buddies can therefore
+ * coexist, and query_page_counts() reports the unmerged lists. Limit 0
+ * (the default) merges eagerly and settles any deferred merges.
+ * buddy_pool_coalesce() settles them on demand, e.g. when idle. Change
+ * the limit only while no other thread uses the pool.
+ */
+int buddy_pool_set_lazy(buddy_pool_t *pool, int limit);
+void buddy_pool_coalesce(buddy_pool_t *pool);
+/*
+ * Deferred frees of BUDDY_POOL_DEFERRED pools. buddy_pool_return() checks
+ * the block as usual, marks it queued (buddy_pool_walk() reports it as
+ * cached, and a second return fails) and pushes it onto its zone's queue
+ * with one compare-and-swap. buddy_pool_drain() takes each zone's whole
+ * queue at once and frees it in address-sorted batches, merging buddies
+ * within a batch before the free lists are touched, as
+ * buddy_pool_return_bulk() does; it returns the number of blocks freed.
+ * Drains of a zone are serialized, so any thread may call it, typically
+ * the background thread of buddy_os_drainer_start(). An allocation that
+ * would fail drains its zone's queue and retries, so queued blocks stay
+ * usable. Bulk, exact and per-thread cache returns free at once.
+ */
+int buddy_pool_drain(buddy_pool_t *pool);
+/*
+ * Reclaim pass for BUDDY_POOL_OFFPAGE pools: hand every warm free block of
+ * at least min_rank to decommit(addr, len, arg), e.g. buddy_os_decommit()
+ * from buddy_os.h, and keep it on its rank's cold list. Allocations take
+ * warm blocks of a rank before cold ones (address-ordered pools keep
+ * their order), and a block freed next to a cold buddy merges with it
+ * into a warm block. Memory handed out from a cold block must be usable
+ * again once touched, as after MADV_DONTNEED. Returns the number of pages
+ * passed to decommit, which runs with the rank locked and must not call
+ * into the pool.
+ */
+typedef void (*buddy_decommit_fn)(void *addr, unsigned long len, void *arg);
+int buddy_pool_reclaim(buddy_pool_t *pool, int min_rank,
+                       buddy_decommit_fn decommit, void *arg);
+int buddy_pool_alloc_bulk(buddy_pool_t *pool, int rank, int n, void **out);
+int buddy_pool_return_bulk(buddy_pool_t *pool, void **pages, int n);
+void *buddy_pool_alloc_exact(buddy_pool_t *pool, int npages);
+int buddy_pool_return_exact(buddy_pool_t *pool, void *p, int npages);
+void *buddy_pool_realloc(buddy_pool_t *pool, void *p, int new_rank);
+/* Relocation callback of buddy_compact() */
+typedef int (*buddy_move_fn)(void *from, void *to, int rank, void *arg);
+int buddy_pool_compact(buddy_pool_t *pool, int target_rank, int max_moves,
+                       buddy_move_fn move, void *arg);
+void *buddy_pool_alloc_constrained(buddy_pool_t *pool, int rank, int min_align_rank,
+                                   unsigned long lo_addr, unsigned long hi_addr);
+int buddy_pool_query_ranks(buddy_pool_t *pool, void *p);
+int buddy_pool_query_page_counts(buddy_pool_t *pool, int rank);
+buddy_pool_t *buddy_default_pool(void);
+
+/*
+ * Statistics of a pool created with BUDDY_POOL_STATS. alloc/free count
+ * successful calls per rank (bulk calls count every block), enospc counts
+ * failed allocations per requested rank. A split halves one block and a
+ * merge joins two buddies, so avg_merge_chain is merges per free.
+ * largest_free_rank is 0 when nothing is free. Counters cover the pool
+ * itself; hits in a per-thread cache never reach it.
+ */
+struct buddy_stats {
+    unsigned long alloc[BUDDY_MAXRANK + 1];
+    unsigned long free[BUDDY_MAXRANK + 1];
+    unsigned long enospc[BUDDY_MAXRANK + 1];
+    unsigned long splits;
+    unsigned long merges;
+    unsigned long invalid_frees;              /* rejected with -EINVAL */
+    double avg_merge_chain;
+    int largest_free_rank;
+};
+
+int buddy_pool_get_stats(buddy_pool_t *pool, struct buddy_stats *stats);
+void buddy_pool_reset_stats(buddy_pool_t *pool);
+
+/*
+ * Free space snapshot: free blocks per rank, their total in pages and the
+ * largest rank with a free block (0 if none). In a thread-safe pool the
+ * ranks are read one after another, so concurrent calls can skew it.
+ *
+ * The indices for a target rank follow Linux and are scaled by 1000:
+ *
+ * buddy_unusable_index()       share of the free pages that sit in
+ *                              blocks smaller than rank; 0 if nothing
+ *                              is free
+ * buddy_fragmentation_index()  why a rank allocation would fail: near 0
+ *                              for lack of free memory, near 1000
+ *                              because it is split into small blocks;
+ *                              -1000 if the allocation would succeed
+ *
+ * Both return -EINVAL for a bad rank.
+ */
+struct buddy_free_info {
+    int blocks[BUDDY_MAXRANK + 1];
+    long free_pages;
+    long cold_pages;          /* free pages decommitted by buddy_pool_reclaim() */
+    int largest_free_rank;
+};
+
+int buddy_pool_query_free(buddy_pool_t *pool, struct buddy_free_info *info);
+int buddy_unusable_index(const struct buddy_free_info *info, int rank);
+int buddy_fragmentation_index(const struct buddy_free_info *info, int rank);
+
+/*
+ * Debugging and occupancy.
+ *
+ * buddy_pool_check() validates the pool's metadata in one pass over it:
+ * the blocks tile the pool, every mark is well formed, the free lists
+ * match the marks with correct prev links, counts, the free mask and
+ * address-ordered bitmaps agree, and an eager pool has no pair of free
+ * buddies left unmerged. It covers every zone and returns OK, or -EINVAL
+ * at the first broken invariant. Call it while no other thread uses the
+ * pool: blocks in the middle of a split or merge look broken.
+ *
+ * buddy_pool_walk() calls fn for every block in address order, zone by
+ * zone, with its rank and a BUDDY_BLOCK_* state (0 for a warm free
+ * block). It takes no locks, so it can run next to other threads and
+ * then sees each block's state at some point during the walk; blocks
+ * that change as it passes may be skipped. A non-zero return from fn
+ * stops the walk and is returned; otherwise the walk returns 0.
+ */
+#define BUDDY_BLOCK_ALLOCATED 0x1
+#define BUDDY_BLOCK_COLD      0x2  /* free and decommitted */
+#define BUDDY_BLOCK_EXACT     0x4  /* piece of an alloc_exact range */
+#define BUDDY_BLOCK_CACHED    0x8  /* held by a pcp, or queued */
+
+typedef int (*buddy_walk_fn)(void *addr, int rank, int state, void *arg);
+int buddy_pool_check(buddy_pool_t *pool);
+int buddy_pool_walk(buddy_pool_t *pool, buddy_walk_fn fn, void *arg);
+
+/*
+ * Snapshots for a warm restart. buddy_pool_snapshot() writes the pool's
+ * state into buf as one buddy_snapshot header followed, at meta_offset,
+ * by an image of its metadata: the page_rank array and, word aligned
+ * after it, the side tables of its flags. Nothing in it is a pointer, so
+ * it can be written to a file and memory-mapped again later.
+ * buddy_pool_restore() brings a pool back from it on the arena at p,
+ * which must hold what it held when the snapshot was taken: free blocks
+ * keep their list links in their own pages unless the pool is
+ * BUDDY_POOL_OFFPAGE. meta is where the restored pool keeps its
+ * metadata, buddy_meta_size_ex() bytes that receive a copy of the image;
+ * with meta NULL the pool uses the image in place, so the snapshot must
+ * stay mapped and writable while the pool is in use, and a later
+ * snapshot into the same buffer only rewrites the header. Either way a
+ * restore costs time in the size of the metadata copied, not in the
+ * number of live blocks.
+ *
+ * Take a snapshot while no other thread uses the pool, after draining
+ * any per-thread caches; a BUDDY_POOL_DEFERRED pool is drained first.
+ * Statistics restart from zero, and pools grown by buddy_pool_add_region()
+ * cannot be snapshotted. The format is in host byte order and specific
+ * to BUDDY_PAGE_SHIFT and BUDDY_MAXRANK. A restore checks the header but
+ * trusts the image; buddy_pool_check() validates it in full.
+ *
+ * buddy_pool_snapshot_size() is the buffer size needed, 0 for a pool with
+ * regions. buddy_pool_snapshot() returns OK, -ENOSPC if len is smaller,
+ * or -EINVAL; buddy_pool_restore() returns OK, or -EINVAL for a bad or
+ * truncated snapshot, leaving *pool and meta untouched.
+ */
+#define BUDDY_SNAPSHOT_MAGIC "BDYSNAP1"
+#define BUDDY_SNAPSHOT_VERSION 1
+
+struct buddy_snapshot_area {
+    int head;
+    int count;
+    int pending;
+    int cold_head;
+    int cold_count;
+};
+
+struct buddy_snapshot {
+    char magic[8];
+    int version;
+    int header_size;                          /* sizeof(struct buddy_snapshot) */
+    int page_shift;
+    int maxrank;
+    int flags;
+    int total_pages;
+    int lazy_limit;
+    unsigned int free_mask;
+    unsigned int class_mask[BUDDY_CLASSES];
+    unsigned long long meta_offset;           /* from the start of the snapshot */
+    unsigned long long meta_size;
+    struct buddy_snapshot_area area[BUDDY_MAXRANK + 1];
+    struct buddy_snapshot_area class_area[BUDDY_CLASSES][BUDDY_MAXRANK];
+};
+
+unsigned long buddy_pool_snapshot_size(buddy_pool_t *pool);
+int buddy_pool_snapshot(buddy_pool_t *pool, void *buf, unsigned long len);
+int buddy_pool_restore(buddy_pool_t *pool, void *p, void *snapshot, unsigned long len,
+                       void *meta);
+
+/*
+ * Pools shared between processes. buddy_pool_create_shared() lays a
+ * thread-safe pool of pgcount pages out in segment: the pool structure
+ * first, then the pages from the next page boundary, then the metadata,
+ * buddy_shared_size() bytes in all. segment is memory every process maps,
+ * e.g. from shm_open() (see buddy_os_shared_open()), page aligned but at
+ * any address in each of them: the pool keeps offsets rather than
+ * pointers and its list links are page indices, so nothing in the
+ * segment depends on where it is mapped. The other processes get their
+ * view of the pool from buddy_pool_attach_shared() on their own mapping,
+ * which fails until the creator has finished. Every pool call then works
+ * across processes as it does across threads, the locks being atomic
+ * words in the segment. Blocks are passed between processes as offsets
+ * from the pool, (char *)p - (char *)pool, since each process sees them
+ * at its own address.
+ *
+ * Shared pools cannot grow with buddy_pool_add_region(). Their locks are
+ * spinlocks with no owner, so a process that dies inside a pool call can
+ * leave the pool locked or inconsistent, and blocks it held stay
+ * allocated. Both return the pool in segment, or -EINVAL.
+ */
+unsigned long buddy_shared_size(int pgcount, int flags);
+buddy_pool_t *buddy_pool_create_shared(void *segment, int pgcount, int flags);
+buddy_pool_t *buddy_pool_attach_shared(void *segment);
+
+/*
+ * Per-thread page cache in front of a pool for ranks up to
+ * BUDDY_PCP_MAXRANK. Cached pages stay allocated as far as the pool is
+ * concerned, so alloc/return pairs that hit the cache do no splitting or
+ * merging; they are marked cached, so a second return fails and
+ * compaction leaves them in place. An empty cache refills to `low` blocks
+ * from the pool; a return that finds `high` blocks cached first drains
+ * back down to `low`.
+ * 0 <= low < high <= BUDDY_PCP_MAX. A cache must only be used by one
+ * thread at a time; buddy_pcp_drain() hands everything back to the pool.
+ */
+#define BUDDY_PCP_MAXRANK 2
+#define BUDDY_PCP_MAX 512
+
+typedef struct buddy_pcp {
+    buddy_pool_t *pool;
+    int low;
+    int high;
+    int count[BUDDY_PCP_MAXRANK];
+    int pages[BUDDY_PCP_MAXRANK][BUDDY_PCP_MAX];  /* page indices, LIFO */
+} buddy_pcp_t;
+
+int buddy_pcp_init(buddy_pcp_t *pcp, buddy_pool_t *pool, int low, int high);
+void *buddy_pcp_alloc(buddy_pcp_t *pcp, int rank);
+int buddy_pcp_return(buddy_pcp_t *pcp, void *p);
+void buddy_pcp_drain(buddy_pcp_t *pcp);
 void *alloc_pages(int rank);
+void *alloc_pages_class(int rank, int cls);
 int return_pages(void *p);
 int query_ranks(void *p);
 int query_page_counts(int rank);
+int buddy_add_region(void *p, int pgcount);
+int buddy_check(void);
+int buddy_walk(buddy_walk_fn fn, void *arg);
+unsigned long buddy_snapshot_size(void);
+int buddy_snapshot(void *buf, unsigned long len);
+int buddy_restore(void *p, void *snapshot, unsigned long len, void *meta);
+
+/*
+ * Allocate n blocks of the same rank into out[]. One free block is split
+ * to feed as many of them as it can hold. Returns the number allocated,
+ * which is less than n only when the pool ran out, -ENOSPC if none could
+ * be allocated, or -EINVAL.
+ *
+ * Return n blocks at once. Buddies that are both in the batch are merged
+ * before the free lists are touched, and the contents of pages[] are
+ * unspecified afterwards. Invalid entries are skipped and make the call
+ * return -EINVAL, all other blocks are still returned.
+ */
+int alloc_pages_bulk(int rank, int n, void **out);
+int return_pages_bulk(void **pages, int n);
+
+/*
+ * Allocate npages contiguous pages, 1 <= npages <= 2^(MAXRANK-1). The
+ * smallest block that holds them is split and the unused tail returned to
+ * the free lists right away. The range is kept as aligned power-of-two
+ * pieces, largest first; query_ranks() reports the rank of the piece a
+ * page is in. Exact ranges must be freed with return_pages_exact() and
+ * the same npages, which returns -EINVAL for anything else; the other
+ * free functions reject them.
+ */
+void *alloc_pages_exact(int npages);
+int return_pages_exact(void *p, int npages);
+
+/*
+ * Resize an allocated block to new_rank, keeping its contents up to the
+ * smaller size. Shrinking always happens in place and frees the upper
+ * part. Growing happens in place when the block is the left half of its
+ * new_rank ancestor and every buddy to its right is a free whole block;
+ * otherwise the contents move to a new block and the old one is freed.
+ * Returns the block's address, or an error with the block unchanged:
+ * -ENOSPC if a move found no room, -EINVAL for a bad new_rank or a
+ * pointer that return_pages() would reject.
+ */
+void *realloc_pages(void *p, int new_rank);
+
+/*
+ * Compaction pass, meant for idle time: find the target_rank-aligned
+ * region with the fewest allocated pages whose blocks can all be moved
+ * (in a grouped pool, the ones allocated as BUDDY_CLASS_MOVABLE; in any
+ * other pool every block from alloc_pages() or its bulk and constrained
+ * variants; never one held by a buddy_pcp_t), and evacuate it so that it
+ * merges into one free block. For each live block, in address order, the
+ * allocator picks a new block of the same rank outside the region through
+ * the pool's address index and calls move(from, to, rank, arg):
+ * the owner copies the contents, points its references at `to` and
+ * returns 0, after which `from` is freed; a non-zero return refuses the
+ * move and ends the pass with the block left where it was. At most
+ * max_moves blocks are moved per call, so a large region is evacuated
+ * over several calls; the next call resumes it. A block whose move was
+ * refused or found no room elsewhere is remembered, and its region passed
+ * over, until it is freed or the next 8 such blocks replace it; later
+ * calls go on with the other regions meanwhile. Each call sizes up
+ * at most 65536 pages of regions per zone, going on from where the last
+ * one stopped, so in a large pool the region is the best of that stretch.
+ * Returns the number of blocks moved, 0 if a free block of target_rank
+ * or more already exists or no region in the stretch qualifies, -EINVAL
+ * for bad arguments or a pool with neither BUDDY_POOL_ADDRESS_INDEX nor
+ * BUDDY_POOL_ADDRESS_ORDERED. move runs with no lock held and may call
+ * into the pool; its owner must not free or resize the block meanwhile.
+ */
+int buddy_compact(int target_rank, int max_moves, buddy_move_fn move, void *arg);
+
+/*
+ * Allocate a rank block within [lo_addr, hi_addr) whose address is a
+ * multiple of the size of a min_align_rank block (0 for no alignment
+ * beyond the block's own), e.g. rank 1, 5, 0, 1UL << 32 for a 64 KiB
+ * aligned page below 4 GiB. The smallest free rank with a qualifying
+ * block is split, and only down the path to the chosen block; the block
+ * is the lowest one, found through the free bitmaps of the pool's
+ * BUDDY_POOL_ADDRESS_INDEX or BUDDY_POOL_ADDRESS_ORDERED. Free the block
+ * with return_pages(). Returns -ENOSPC if no free block qualifies,
+ * -EINVAL for a bad rank or alignment, lo_addr >= hi_addr or a pool
+ * without either flag.
+ */
+void *alloc_pages_constrained(int rank, int min_align_rank, unsigned long lo_addr,
+                              unsigned long hi_addr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "buddy_os.h"
+
+#define HUGE_SIZE (1UL << BUDDY_OS_HUGE_SHIFT)
+
+void buddy_os_decommit(void *addr, unsigned long len, void *arg) {
+    (void)arg;
+    // The pages read back as zero when touched again; a failure only
+    // leaves them committed, so there is nothing to report
+    madvise(addr, len, MADV_DONTNEED);
+}
+
+static unsigned long huge_round(unsigned long len) {
+    return (len + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1);
+}
+
+// Transparent huge pages are only worth advising when not disabled
+static int thp_enabled(void) {
+    char mode[64] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fgets(mode, sizeof(mode), f) == NULL) {
+        mode[0] = 0;
+    }
+    fclose(f);
+    return strstr(mode, "[never]") == NULL && mode[0] != 0;
+}
+
+// Map len bytes (a multiple of HUGE_SIZE) aligned to HUGE_SIZE
+static void *map_arena(unsigned long len, int *backing) {
+    void *p;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *backing = BUDDY_OS_HUGETLB;
+        return p;
+    }
+#endif
+
+    // Over-map by one huge page and trim both ends to the alignment
+    char *raw = mmap(NULL, len + HUGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)huge_round((unsigned long)raw);
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + len, raw + HUGE_SIZE - aligned);
+
+    *backing = BUDDY_OS_SMALL_PAGES;
+#ifdef MADV_HUGEPAGE
+    if (thp_enabled() && madvise(aligned, len, MADV_HUGEPAGE) == 0) {
+        *backing = BUDDY_OS_THP;
+    }
+#endif
+    return aligned;
+}
+
+int buddy_os_pool_create(buddy_pool_t *pool, int pgcount, int flags, int *backing) {
+    if (pool == NULL || pgcount <= 0) {
+        return -EINVAL;
+    }
+
+    unsigned long arena_len = huge_round((unsigned long)pgcount * BUDDY_PAGE_SIZE);
+    unsigned long meta_len = buddy_meta_size_ex(pgcount, flags);
+    int got;
+    void *arena = map_arena(arena_len, &got);
+    if (arena == NULL) {
+        return -ENOSPC;
+    }
+    void *meta = mmap(NULL, meta_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (meta == MAP_FAILED) {
+        munmap(arena, arena_len);
+        return -ENOSPC;
+    }
+
+    int ret = buddy_pool_init_ex(pool, arena, pgcount, meta, flags);
+    if (ret != OK) {
+        munmap(arena, arena_len);
+        munmap(meta, meta_len);
+        return ret;
+    }
+    if (backing != NULL) {
+        *backing = got;
+    }
+    return OK;
+}
+
+void buddy_os_pool_destroy(buddy_pool_t *pool) {
+    munmap((char *)pool + pool->memory_start,
+           huge_round((unsigned long)pool->total_pages * BUDDY_PAGE_SIZE));
+    munmap((char *)pool + pool->page_rank,
+           buddy_meta_size_ex(pool->total_pages, pool->flags));
+}
+
+// Map size bytes of the shared memory object fd aligned to BUDDY_PAGE_SIZE,
+// which a plain mmap() only gives for the system's own page size
+static void *map_shared(int fd, unsigned long size) {
+    // Reserve an extra pool page of address space, map the object over
+    // its aligned part and trim both ends, so only the mapping is left
+    char *raw = mmap(NULL, size + BUDDY_PAGE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((unsigned long)raw + BUDDY_PAGE_SIZE - 1) &
+                             ~(BUDDY_PAGE_SIZE - 1));
+    void *segment = mmap(aligned, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                         fd, 0);
+    if (segment == MAP_FAILED) {
+        munmap(raw, size + BUDDY_PAGE_SIZE);
+        return NULL;
+    }
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    unsigned long end = (unsigned long)aligned + size;
+    unsigned long raw_end = (unsigned long)raw + size + BUDDY_PAGE_SIZE;
+    // The object's size need not be a multiple of the system's page size,
+    // so the tail starts at the first system page past the mapping
+    unsigned long sys_page = (unsigned long)sysconf(_SC_PAGESIZE);
+    end = (end + sys_page - 1) & ~(sys_page - 1);
+    if (raw_end > end) {
+        munmap((void *)end, raw_end - end);
+    }
+    return segment;
+}
+
+buddy_pool_t *buddy_os_shared_open(const char *name, int pgcount, int flags) {
+    if (name == NULL) {
+        return ERR_PTR(-EINVAL);
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        unsigned long size = buddy_shared_size(pgcount, flags);
+        void *segment = NULL;
+        if (size > 0 && ftruncate(fd, (off_t)size) == 0) {
+            segment = map_shared(fd, size);
+        }
+        close(fd);
+        if (segment == NULL) {
+            shm_unlink(name);
+            return ERR_PTR(size == 0 ? -EINVAL : -ENOSPC);
+        }
+        buddy_pool_t *pool = buddy_pool_create_shared(segment, pgcount, flags);
+        if (IS_ERR(pool)) {
+            munmap(segment, size);
+            shm_unlink(name);
+        }
+        return pool;
+    }
+    if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    // The creator sizes the segment before it initialises the pool, whose
+    // own geometry then gives the size to map
+    struct timespec tick = {0, 1000000};
+    buddy_pool_t *pool = ERR_PTR(-EINVAL);
+    for (int waited = 0; waited < 1000 && IS_ERR(pool); waited++) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (unsigned long)st.st_size >= sizeof(buddy_pool_t)) {
+            void *segment = map_shared(fd, (unsigned long)st.st_size);
+            if (segment == NULL) {
+                close(fd);
+                return ERR_PTR(-ENOSPC);
+            }
+            pool = buddy_pool_attach_shared(segment);
+            if (IS_ERR(pool)) {
+                munmap(segment, (unsigned long)st.st_size);
+            }
+        }
+        if (IS_ERR(pool)) {
+            nanosleep(&tick, NULL);
+        }
+    }
+    close(fd);
+    return pool;
+}
+
+void buddy_os_shared_close(buddy_pool_t *pool) {
+    munmap(pool, buddy_shared_size(pool->total_pages, pool->flags));
+}
+
+int buddy_os_shared_unlink(const char *name) {
+    return name != NULL && shm_unlink(name) == 0 ? OK : -EINVAL;
+}
+
+static void *drainer_main(void *arg) {
+    buddy_os_drainer_t *drainer = arg;
+    struct timespec interval = {drainer->interval_us / 1000000,
+                                drainer->interval_us % 1000000 * 1000L};
+    while (!__atomic_load_n(&drainer->stop, __ATOMIC_ACQUIRE)) {
+        buddy_pool_drain(drainer->pool);
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int buddy_os_drainer_start(buddy_os_drainer_t *drainer, buddy_pool_t *pool,
+                           int interval_us) {
+    if (drainer == NULL || pool == NULL || interval_us <= 0 ||
+        (pool->flags & (BUDDY_POOL_THREADSAFE | BUDDY_POOL_DEFERRED)) !=
+            (BUDDY_POOL_THREADSAFE | BUDDY_POOL_DEFERRED)) {
+        return -EINVAL;
+    }
+    drainer->pool = pool;
+    drainer->interval_us = interval_us;
+    drainer->stop = 0;
+    if (pthread_create(&drainer->thread, NULL, drainer_main, drainer) != 0) {
+        return -ENOSPC;
+    }
+    return OK;
+}
+
+void buddy_os_drainer_stop(buddy_os_drainer_t *drainer) {
+    __atomic_store_n(&drainer->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(drainer->thread, NULL);
+    // Frees queued after the thread's last pass
+    buddy_pool_drain(drainer->pool);
+}
@@ -0,0 +1,74 @@
+#ifndef BUDDY_OS_H
+#define BUDDY_OS_H
+
+#include <pthread.h>
+
+#include "buddy.h"
+
+/*
+ * Operating system helpers for buddy pools. buddy.c itself stays free of
+ * system calls; link buddy_os.c to use these.
+ */
+
+/* buddy_decommit_fn for buddy_pool_reclaim(): MADV_DONTNEED the range */
+void buddy_os_decommit(void *addr, unsigned long len, void *arg);
+
+/*
+ * Create a pool of pgcount pages on memory mapped for it, aligned to
+ * 2 MiB so that blocks of rank 10 and up cover whole huge pages. The
+ * arena is taken from reserved huge pages (MAP_HUGETLB) if there are
+ * enough, otherwise it is mapped normally and advised for transparent
+ * huge pages. The metadata is mapped separately. *backing, if not NULL,
+ * receives what the arena got; BUDDY_OS_THP means huge pages were
+ * requested, the kernel may still use small pages for some ranges.
+ * flags are passed to buddy_pool_init_ex(). Returns OK, -EINVAL, or
+ * -ENOSPC if nothing could be mapped. buddy_os_pool_destroy() unmaps a
+ * pool created here.
+ */
+#define BUDDY_OS_HUGE_SHIFT 21
+
+enum {
+    BUDDY_OS_SMALL_PAGES,
+    BUDDY_OS_THP,
+    BUDDY_OS_HUGETLB,
+};
+
+int buddy_os_pool_create(buddy_pool_t *pool, int pgcount, int flags, int *backing);
+void buddy_os_pool_destroy(buddy_pool_t *pool);
+
+/*
+ * Open the shared pool named name (a shm_open() name such as "/msgs"),
+ * creating it with pgcount pages and flags if it does not exist yet;
+ * otherwise pgcount and flags are ignored and the pool is attached, after
+ * waiting up to a second for its creator to finish. Each call maps the
+ * segment anew, at whatever address the system picks. Returns the pool,
+ * -ENOSPC if the segment cannot be created or mapped, or -EINVAL.
+ * buddy_os_shared_close() unmaps it from the calling process, and
+ * buddy_os_shared_unlink() removes the name, the segment going away with
+ * its last mapping.
+ */
+buddy_pool_t *buddy_os_shared_open(const char *name, int pgcount, int flags);
+void buddy_os_shared_close(buddy_pool_t *pool);
+int buddy_os_shared_unlink(const char *name);
+
+/*
+ * Background drainer for a thread-safe BUDDY_POOL_DEFERRED pool: a thread
+ * that calls buddy_pool_drain() until the queues are empty, then sleeps interval_us
+ * microseconds before looking again. Allocations drain the queues
+ * themselves before failing, so the interval only bounds how long freed
+ * blocks stay unmerged. buddy_os_drainer_stop() joins the thread and
+ * drains once more, leaving nothing queued. Returns OK, -EINVAL, or
+ * -ENOSPC if the thread could not be created.
+ */
+typedef struct buddy_os_drainer {
+    buddy_pool_t *pool;
+    pthread_t thread;
+    int interval_us;
+    int stop;
+} buddy_os_drainer_t;
+
+int buddy_os_drainer_start(buddy_os_drainer_t *drainer, buddy_pool_t *pool,
+                           int interval_us);
+void buddy_os_drainer_stop(buddy_os_drainer_t *drainer);
+
+#endif
@@ -0,0 +1,302 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "trace.h"
+
+/*
+ * Replay an allocator trace (see trace.h) against buddy.c.
+ *
+ * The whole trace is loaded before replaying, and this driver is built
+ * without BUDDY_TRACE, so the default pass measures the allocator alone:
+ *
+ *   replay trace              ops/sec over the whole trace
+ *   replay -l trace           also p50/p99/p999 ns per alloc and free
+ *   replay -f N trace         also free space of pool 0 every N records,
+ *                             with the unusable index for MAXRANK
+ *   replay -c trace           also the number of records of each kind
+ *
+ * Records that cannot be reproduced (an alloc that fails now but did not
+ * when recorded, and the later free of that block) are counted as
+ * divergences and skipped.
+ */
+
+#define MAX_POOLS 256
+
+struct replay_pool {
+    buddy_pool_t pool;
+    int capacity;  // pages the arena, meta and ptrs are sized for
+    void *arena;
+    void *meta;
+    void **ptrs;  // id -> block, NULL when not live
+};
+
+static struct replay_pool pools[MAX_POOLS];
+static struct buddy_trace_record *records;
+static long nrecords;
+static long divergences;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        printf("cannot open %s\n", path);
+        return -1;
+    }
+    struct buddy_trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, BUDDY_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        le32toh(header.version) != BUDDY_TRACE_VERSION ||
+        le32toh(header.record_size) != sizeof(struct buddy_trace_record)) {
+        printf("%s: not a version %d buddy trace\n", path, BUDDY_TRACE_VERSION);
+        fclose(f);
+        return -1;
+    }
+
+    long start = ftell(f);
+    fseek(f, 0, SEEK_END);
+    nrecords = (ftell(f) - start) / (long)sizeof(struct buddy_trace_record);
+    fseek(f, start, SEEK_SET);
+    records = malloc((nrecords > 0 ? nrecords : 1) * sizeof(*records));
+    if (records == NULL ||
+        (long)fread(records, sizeof(*records), nrecords, f) != nrecords) {
+        printf("%s: read failed\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    for (long i = 0; i < nrecords; i++) {
+        records[i].ts = le64toh(records[i].ts);
+        records[i].id = le32toh(records[i].id);
+        records[i].pages = le32toh(records[i].pages);
+    }
+    return 0;
+}
+
+// Size a pool's arena for pgcount pages, keeping it when it is big enough
+static void reserve_pool(struct replay_pool *rp, int pgcount) {
+    if (rp->capacity < pgcount) {
+        free(rp->arena);
+        free(rp->meta);
+        free(rp->ptrs);
+        rp->capacity = pgcount;
+        rp->arena = aligned_alloc(BUDDY_PAGE_SIZE, (size_t)pgcount * BUDDY_PAGE_SIZE);
+        rp->meta = malloc(buddy_meta_size(pgcount));
+        rp->ptrs = malloc((size_t)pgcount * sizeof(void *));
+        if (rp->arena == NULL || rp->meta == NULL || rp->ptrs == NULL) {
+            printf("out of memory for a %d page pool\n", pgcount);
+            exit(-1);
+        }
+        // Fault the arena in now so the replay does not time page faults
+        memset(rp->arena, 0, (size_t)pgcount * BUDDY_PAGE_SIZE);
+    }
+}
+
+static int init_pool(struct replay_pool *rp, int pgcount) {
+    reserve_pool(rp, pgcount);
+    memset(rp->ptrs, 0, (size_t)pgcount * sizeof(void *));
+    return buddy_pool_init_meta(&rp->pool, rp->arena, pgcount, rp->meta);
+}
+
+// Replay one record; returns 1 for an alloc, 2 for a free, 0 otherwise
+static int replay_record(const struct buddy_trace_record *rec) {
+    struct replay_pool *rp = &pools[rec->pool];
+    void *p;
+
+    switch (rec->op) {
+    case BUDDY_TRACE_INIT:
+        if (init_pool(rp, (int)rec->id) != OK) {
+            printf("cannot init a %u page pool\n", rec->id);
+            exit(-1);
+        }
+        return 0;
+    case BUDDY_TRACE_ALLOC:
+        if (rp->ptrs == NULL || rec->id >= (uint32_t)rp->capacity) {
+            divergences++;
+            return 0;
+        }
+        p = buddy_pool_alloc(&rp->pool, rec->rank);
+        if (IS_ERR(p)) {
+            divergences++;
+            p = NULL;
+        }
+        rp->ptrs[rec->id] = p;
+        return 1;
+    case BUDDY_TRACE_FREE:
+        if (rp->ptrs == NULL || rec->id >= (uint32_t)rp->capacity ||
+            rp->ptrs[rec->id] == NULL) {
+            divergences++;
+            return 0;
+        }
+        buddy_pool_return(&rp->pool, rp->ptrs[rec->id]);
+        rp->ptrs[rec->id] = NULL;
+        return 2;
+    case BUDDY_TRACE_ENOSPC:
+        // Reproduce the failed attempt; if it succeeds now, undo it
+        if (rp->ptrs == NULL) {
+            return 0;
+        }
+        if (rec->pages > 0) {
+            p = buddy_pool_alloc_exact(&rp->pool, (int)rec->pages);
+            if (!IS_ERR(p)) {
+                divergences++;
+                buddy_pool_return_exact(&rp->pool, p, (int)rec->pages);
+            }
+            return 1;
+        }
+        p = buddy_pool_alloc(&rp->pool, rec->rank);
+        if (!IS_ERR(p)) {
+            divergences++;
+            buddy_pool_return(&rp->pool, p);
+        }
+        return 1;
+    case BUDDY_TRACE_ALLOC_EXACT:
+        if (rp->ptrs == NULL || rec->id >= (uint32_t)rp->capacity) {
+            divergences++;
+            return 0;
+        }
+        p = buddy_pool_alloc_exact(&rp->pool, (int)rec->pages);
+        if (IS_ERR(p)) {
+            divergences++;
+            p = NULL;
+        }
+        rp->ptrs[rec->id] = p;
+        return 1;
+    case BUDDY_TRACE_FREE_EXACT:
+        if (rp->ptrs == NULL || rec->id >= (uint32_t)rp->capacity ||
+            rp->ptrs[rec->id] == NULL) {
+            divergences++;
+            return 0;
+        }
+        buddy_pool_return_exact(&rp->pool, rp->ptrs[rec->id], (int)rec->pages);
+        rp->ptrs[rec->id] = NULL;
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static void print_free_space(long at) {
+    struct buddy_free_info info;
+    buddy_pool_query_free(&pools[0].pool, &info);
+    long free_blocks = 0;
+    for (int rank = 1; rank <= BUDDY_MAXRANK; rank++) {
+        free_blocks += info.blocks[rank];
+    }
+    printf("  %12ld %12ld %12ld %8d %8d\n", at, info.free_pages, free_blocks,
+           info.largest_free_rank, buddy_unusable_index(&info, BUDDY_MAXRANK));
+}
+
+static int cmp_uint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *what, unsigned int *lat, long n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(lat, n, sizeof(*lat), cmp_uint);
+    printf("  %-6s %10ld ops  p50 %6uns  p99 %6uns  p999 %6uns\n", what, n,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000]);
+}
+
+int main(int argc, char **argv) {
+    int latency = 0, counts = 0;
+    long interval = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            latency = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            counts = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            interval = atol(argv[++i]);
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL || interval < 0) {
+        printf("usage: %s [-l] [-c] [-f interval] trace\n", argv[0]);
+        return -1;
+    }
+    if (load_trace(path) != 0) {
+        return -1;
+    }
+
+    // Set up every arena the trace needs before timing anything
+    for (long i = 0; i < nrecords; i++) {
+        if (records[i].op == BUDDY_TRACE_INIT) {
+            reserve_pool(&pools[records[i].pool], (int)records[i].id);
+        }
+    }
+
+    // Bulk pass: nothing but the allocator inside the loop
+    long start = now_ns();
+    for (long i = 0; i < nrecords; i++) {
+        replay_record(&records[i]);
+    }
+    long elapsed = now_ns() - start;
+    printf("%ld records in %.3f ms: %.2f Mops/s, %ld divergences\n", nrecords,
+           elapsed / 1e6, elapsed > 0 ? nrecords * 1e3 / elapsed : 0.0, divergences);
+
+    if (counts) {
+        long count[BUDDY_TRACE_FREE_EXACT + 1] = {0};
+        for (long i = 0; i < nrecords; i++) {
+            if (records[i].op <= BUDDY_TRACE_FREE_EXACT) {
+                count[records[i].op]++;
+            }
+        }
+        printf("%ld init, %ld alloc, %ld free, %ld enospc, %ld alloc_exact, "
+               "%ld free_exact\n",
+               count[BUDDY_TRACE_INIT], count[BUDDY_TRACE_ALLOC], count[BUDDY_TRACE_FREE],
+               count[BUDDY_TRACE_ENOSPC], count[BUDDY_TRACE_ALLOC_EXACT],
+               count[BUDDY_TRACE_FREE_EXACT]);
+    }
+
+    if (latency) {
+        unsigned int *alloc_lat = malloc(nrecords * sizeof(unsigned int) + 1);
+        unsigned int *free_lat = malloc(nrecords * sizeof(unsigned int) + 1);
+        long nalloc = 0, nfree = 0;
+        if (alloc_lat == NULL || free_lat == NULL) {
+            printf("out of memory\n");
+            return -1;
+        }
+        for (long i = 0; i < nrecords; i++) {
+            long t = now_ns();
+            int kind = replay_record(&records[i]);
+            unsigned int ns = (unsigned int)(now_ns() - t);
+            if (kind == 1) {
+                alloc_lat[nalloc++] = ns;
+            } else if (kind == 2) {
+                free_lat[nfree++] = ns;
+            }
+        }
+        printf("latency (including timer):\n");
+        print_percentiles("alloc", alloc_lat, nalloc);
+        print_percentiles("free", free_lat, nfree);
+        free(alloc_lat);
+        free(free_lat);
+    }
+
+    if (interval > 0) {
+        printf("free space of pool 0:\n");
+        printf("  %12s %12s %12s %8s %8s\n", "record", "free pages", "free blocks",
+               "largest", "unusable");
+        for (long i = 0; i < nrecords; i++) {
+            replay_record(&records[i]);
+            if ((i + 1) % interval == 0 && pools[0].ptrs != NULL) {
+                print_free_space(i + 1);
+            }
+        }
+    }
+    return 0;
+}
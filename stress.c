@@ -0,0 +1,322 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buddy.h"
+#include "buddy_os.h"
+
+/*
+ * Multi-threaded stress test for BUDDY_POOL_THREADSAFE pools.
+ *
+ * Every thread runs a random mix of allocations and frees, stamps each
+ * block it owns at its first and last word and checks the stamps before
+ * returning it, so two threads handed overlapping blocks are caught.
+ * After each run the pool must have merged back into the free blocks it
+ * started with. Runs are repeated for 1, 2, 4, ... threads and these modes:
+ *
+ *   mutex   flags 0 pool behind one global mutex (the old workaround)
+ *   pool    thread-safe pool, fine-grained locks only
+ *   pcp     thread-safe pool with a per-thread page cache in front
+ *   lazy    thread-safe pool with lazy coalescing
+ *   addr    thread-safe pool with address-ordered placement
+ *   offpage thread-safe pool with its free lists in the metadata
+ *   reclaim offpage pool whose thread 0 also decommits free blocks of
+ *           rank 4 and up every 4096 operations
+ *   zones   thread-safe pool on the first quarter of the arena, grown by
+ *           the other three quarters as regions
+ *   hardened hardened thread-safe pool with a per-thread page cache
+ *   realloc thread-safe pool where a quarter of the operations resize
+ *           a live block up or down a rank, in place or by moving it
+ *   classes thread-safe pool grouped into rank-6 pageblocks, with every
+ *           allocation in a random class, and an address index
+ *   deferred thread-safe pool queueing its frees for a background drainer
+ *
+ * usage: stress [max_threads] [ops_per_thread]
+ */
+
+#define MAXRANK BUDDY_MAXRANK
+#define TESTSIZE (128)
+#define PAGES ((int)(TESTSIZE * 1024L * 1024 / BUDDY_PAGE_SIZE))
+#define LIVE_MAX 4096
+
+enum mode {
+    MODE_MUTEX, MODE_POOL, MODE_PCP, MODE_LAZY, MODE_ADDR, MODE_OFFPAGE, MODE_RECLAIM,
+    MODE_ZONES, MODE_HARDENED, MODE_REALLOC, MODE_CLASSES, MODE_DEFERRED
+};
+static const char *mode_name[] = {"mutex", "pool", "pcp", "lazy", "addr", "offpage",
+                                  "reclaim", "zones", "hardened", "realloc", "classes",
+                                  "deferred"};
+
+static buddy_pool_t pool;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *arena;
+static void *meta;
+static int run_mode;
+static long ops_per_thread;
+
+struct worker {
+    pthread_t tid;
+    int id;
+    long failures;
+    buddy_pcp_t pcp;
+    void *live[LIVE_MAX];
+    int live_rank[LIVE_MAX];
+    unsigned long live_stamp[LIVE_MAX];
+};
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *do_alloc(struct worker *w, int rank, unsigned long r) {
+    void *p;
+    switch (run_mode) {
+    case MODE_MUTEX:
+        pthread_mutex_lock(&pool_mutex);
+        p = buddy_pool_alloc(&pool, rank);
+        pthread_mutex_unlock(&pool_mutex);
+        return p;
+    case MODE_PCP:
+    case MODE_HARDENED:
+        return buddy_pcp_alloc(&w->pcp, rank);
+    case MODE_CLASSES:
+        return buddy_pool_alloc_class(&pool, rank, (int)((r >> 24) % BUDDY_CLASSES));
+    default:
+        return buddy_pool_alloc(&pool, rank);
+    }
+}
+
+static int do_return(struct worker *w, void *p) {
+    int ret;
+    switch (run_mode) {
+    case MODE_MUTEX:
+        pthread_mutex_lock(&pool_mutex);
+        ret = buddy_pool_return(&pool, p);
+        pthread_mutex_unlock(&pool_mutex);
+        return ret;
+    case MODE_PCP:
+    case MODE_HARDENED:
+        return buddy_pcp_return(&w->pcp, p);
+    default:
+        return buddy_pool_return(&pool, p);
+    }
+}
+
+static unsigned long *last_word(void *p, int rank) {
+    return (unsigned long *)((char *)p + (BUDDY_PAGE_SIZE << (rank - 1))) - 1;
+}
+
+static void check_and_free(struct worker *w, int i) {
+    void *p = w->live[i];
+    int rank = w->live_rank[i];
+    if (*(unsigned long *)p != w->live_stamp[i] ||
+        *last_word(p, rank) != w->live_stamp[i]) {
+        printf("thread %d: block %p (rank %d) was overwritten\n", w->id, p, rank);
+        exit(-1);
+    }
+    if (do_return(w, p) != OK) {
+        printf("thread %d: return of %p failed\n", w->id, p);
+        exit(-1);
+    }
+}
+
+// Resize live block i up or down a rank, up to rank 4; its first word
+// must survive
+static void resize(struct worker *w, int i, int up) {
+    int rank = w->live_rank[i] + (up ? 1 : -1);
+    if (rank < 1 || rank > 4) {
+        return;
+    }
+    void *p = buddy_pool_realloc(&pool, w->live[i], rank);
+    if (IS_ERR(p)) {
+        if (PTR_ERR(p) != -ENOSPC) {
+            printf("thread %d: realloc to %d returned %ld\n", w->id, rank, PTR_ERR(p));
+            exit(-1);
+        }
+        w->failures++;
+        return;
+    }
+    if (*(unsigned long *)p != w->live_stamp[i] ||
+        buddy_pool_query_ranks(&pool, p) != rank) {
+        printf("thread %d: block %p resized to rank %d is corrupt\n", w->id, p, rank);
+        exit(-1);
+    }
+    *last_word(p, rank) = w->live_stamp[i];
+    w->live[i] = p;
+    w->live_rank[i] = rank;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    unsigned long rng = 0x9e3779b97f4a7c15UL * (w->id + 1);
+    int nlive = 0;
+
+    for (long op = 0; op < ops_per_thread; op++) {
+        unsigned long r = xorshift(&rng);
+        if (run_mode == MODE_RECLAIM && w->id == 0 && op % 4096 == 0) {
+            buddy_pool_reclaim(&pool, 4, buddy_os_decommit, NULL);
+        }
+        if (run_mode == MODE_REALLOC && nlive > 0 && (r >> 40) % 4 == 0) {
+            resize(w, (int)((r >> 8) % nlive), (r >> 42) & 1);
+            continue;
+        }
+        if (nlive < LIVE_MAX && (nlive == 0 || (r & 1))) {
+            // Mostly rank 1/2, occasionally up to rank 8
+            int rank = (r >> 8) % 16 == 0 ? 1 + (int)((r >> 16) % 8)
+                                           : 1 + (int)((r >> 16) & 1);
+            void *p = do_alloc(w, rank, r);
+            if (IS_ERR(p)) {
+                if (PTR_ERR(p) != -ENOSPC) {
+                    printf("thread %d: alloc_pages(%d) returned %ld\n", w->id,
+                           rank, PTR_ERR(p));
+                    exit(-1);
+                }
+                w->failures++;
+                continue;
+            }
+            if (((char *)p - (char *)arena) % (BUDDY_PAGE_SIZE << (rank - 1)) != 0 ||
+                buddy_pool_query_ranks(&pool, p) != rank) {
+                printf("thread %d: bad block %p for rank %d\n", w->id, p, rank);
+                exit(-1);
+            }
+            unsigned long stamp = ((unsigned long)w->id << 48) | (unsigned long)op;
+            *(unsigned long *)p = stamp;
+            *last_word(p, rank) = stamp;
+            w->live[nlive] = p;
+            w->live_rank[nlive] = rank;
+            w->live_stamp[nlive] = stamp;
+            nlive++;
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            check_and_free(w, i);
+            nlive--;
+            w->live[i] = w->live[nlive];
+            w->live_rank[i] = w->live_rank[nlive];
+            w->live_stamp[i] = w->live_stamp[nlive];
+        }
+    }
+    while (nlive > 0) {
+        check_and_free(w, --nlive);
+    }
+    if (run_mode == MODE_PCP || run_mode == MODE_HARDENED) {
+        buddy_pcp_drain(&w->pcp);
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(int mode, int nthreads, struct worker *workers) {
+    int flags = mode == MODE_MUTEX ? 0 : BUDDY_POOL_THREADSAFE;
+    if (mode == MODE_ADDR) {
+        flags |= BUDDY_POOL_ADDRESS_ORDERED;
+    } else if (mode == MODE_OFFPAGE || mode == MODE_RECLAIM) {
+        flags |= BUDDY_POOL_OFFPAGE;
+    } else if (mode == MODE_HARDENED) {
+        flags |= BUDDY_POOL_HARDENED;
+    } else if (mode == MODE_CLASSES) {
+        flags |= BUDDY_POOL_PAGEBLOCK(6) | BUDDY_POOL_ADDRESS_INDEX;
+    } else if (mode == MODE_DEFERRED) {
+        flags |= BUDDY_POOL_DEFERRED;
+    }
+    int pgcount = mode == MODE_ZONES ? PAGES / 4 : PAGES;
+    if (buddy_pool_init_ex(&pool, arena, pgcount, meta, flags) != OK) {
+        printf("pool init failed\n");
+        exit(-1);
+    }
+    for (int z = 1; mode == MODE_ZONES && z < 4; z++) {
+        if (buddy_pool_add_region(&pool, (char *)arena + z * (PAGES / 4) * BUDDY_PAGE_SIZE,
+                                  PAGES / 4) != OK) {
+            printf("add region failed\n");
+            exit(-1);
+        }
+    }
+    if (mode == MODE_LAZY) {
+        buddy_pool_set_lazy(&pool, 64);
+    }
+    run_mode = mode;
+    struct buddy_free_info before, after;
+    buddy_pool_query_free(&pool, &before);
+    buddy_os_drainer_t drainer;
+    if (mode == MODE_DEFERRED && buddy_os_drainer_start(&drainer, &pool, 100) != OK) {
+        printf("drainer start failed\n");
+        exit(-1);
+    }
+
+    double start = now();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].failures = 0;
+        buddy_pcp_init(&workers[i].pcp, &pool, 32, 128);
+        pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+    long failures = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        failures += workers[i].failures;
+    }
+    double elapsed = now() - start;
+    if (mode == MODE_LAZY) {
+        buddy_pool_coalesce(&pool);
+    } else if (mode == MODE_DEFERRED) {
+        buddy_os_drainer_stop(&drainer);
+    }
+
+    // Everything was returned, so the pool must be fully merged again
+    if (buddy_pool_check(&pool) != OK) {
+        printf("%s/%d: pool inconsistent after run\n", mode_name[mode], nthreads);
+        exit(-1);
+    }
+    buddy_pool_query_free(&pool, &after);
+    if (after.free_pages != before.free_pages) {
+        printf("%s/%d: pages lost after run\n", mode_name[mode], nthreads);
+        exit(-1);
+    }
+    for (int rank = 1; rank <= MAXRANK; rank++) {
+        if (after.blocks[rank] != before.blocks[rank]) {
+            printf("%s/%d: rank %d not merged after run\n", mode_name[mode],
+                   nthreads, rank);
+            exit(-1);
+        }
+    }
+
+    double ops = (double)ops_per_thread * nthreads;
+    printf("%-8s threads=%-3d %8.2f Mops/s  enospc=%ld\n", mode_name[mode],
+           nthreads, ops / elapsed / 1e6, failures);
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    ops_per_thread = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_threads < 1 || ops_per_thread < 1) {
+        printf("usage: %s [max_threads] [ops_per_thread]\n", argv[0]);
+        return -1;
+    }
+
+    arena = aligned_alloc(BUDDY_PAGE_SIZE, TESTSIZE * 1024L * 1024);
+    meta = malloc(buddy_meta_size_ex(PAGES, BUDDY_POOL_ADDRESS_ORDERED |
+                                                BUDDY_POOL_OFFPAGE |
+                                                BUDDY_POOL_PAGEBLOCK(2)));
+    struct worker *workers = calloc(max_threads, sizeof(*workers));
+    if (arena == NULL || meta == NULL || workers == NULL) {
+        printf("out of memory\n");
+        return -1;
+    }
+
+    for (int mode = MODE_MUTEX; mode <= MODE_DEFERRED; mode++) {
+        for (int n = 1; n <= max_threads; n *= 2) {
+            run(mode, n, workers);
+        }
+    }
+    printf("Stress test passed.\n");
+    return 0;
+}
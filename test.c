@@ -0,0 +1,946 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "buddy.h"
+#include "buddy_os.h"
+#ifdef BUDDY_TRACE
+#include "trace.h"
+#endif
+
+/*
+ * Functional checks of pool features that stress.c's random mix of
+ * allocations and frees does not reach, each on a fresh pool:
+ *
+ *   bulk     bulk allocations hand out what is left when the pool runs
+ *            out, bulk returns free every valid entry and merge buddies
+ *            within the batch
+ *   stats    the counters add up to known totals for splits, merges,
+ *            failures and bulk calls, and reset to zero
+ *   indices  the unusable and fragmentation indices of fixed layouts
+ *   exact    exact-size ranges are split into the right pieces, only
+ *            freed whole by return_exact and never overlap
+ *   hardened a hardened pool rejects interior, second and foreign frees
+ *            and counts each one, and of two threads freeing a block at
+ *            once exactly one succeeds
+ *   constrained
+ *            constrained allocations take the lowest qualifying block
+ *            of the smallest rank, and fail only if none is free
+ *   compact  compaction evacuates a region, goes on with other regions
+ *            past a block whose move is refused, and never moves a
+ *            block held by a per-thread cache
+ *   snapshot a pool restored from a snapshot, into its own metadata or
+ *            in place, has the same blocks and keeps working, and a
+ *            failed restore leaves the pool as it was
+ *   shared   forked processes that open a shared pool by name, each at
+ *            its own address, allocate from it at once without handing
+ *            out a block twice, and pass blocks to each other
+ *
+ * usage: test
+ *        test trace    in a -DBUDDY_TRACE build, with $BUDDY_TRACE_FILE
+ *                      set: only a short deterministic mix of the traced
+ *                      calls, printing the records it should leave in the
+ *                      trace as replay -c counts them
+ */
+
+#define MAXRANK BUDDY_MAXRANK
+#define PAGES 4096
+
+#define CHECK(cond)                                                        \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __func__, __LINE__, #cond); \
+            exit(-1);                                                      \
+        }                                                                  \
+    } while (0)
+
+static buddy_pool_t pool;
+static char *arena;
+static void *meta;
+
+static void *page(int idx) {
+    return arena + (long)idx * BUDDY_PAGE_SIZE;
+}
+
+static int page_index(void *p) {
+    return (int)(((char *)p - arena) / BUDDY_PAGE_SIZE);
+}
+
+// The pool must be back to PAGES free pages that pass buddy_pool_check(),
+// once queued frees are drained
+static void check_empty(void) {
+    struct buddy_free_info info;
+    CHECK(buddy_pool_drain(&pool) >= 0);
+    CHECK(buddy_pool_check(&pool) == OK);
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    CHECK(info.free_pages == PAGES);
+}
+
+// Blocks the running test holds
+static void *live[PAGES];
+static int live_rank[PAGES];
+static int nlive;
+
+static unsigned long xorshift(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Bulk allocation and return
+ */
+
+static void test_bulk(int flags) {
+    static void *out[PAGES + 16];
+    static unsigned char owner[PAGES];
+    struct buddy_free_info info;
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags) == OK);
+    CHECK(buddy_pool_alloc_bulk(&pool, 0, 1, out) == -EINVAL);
+    CHECK(buddy_pool_alloc_bulk(&pool, 1, -1, out) == -EINVAL);
+    CHECK(buddy_pool_alloc_bulk(&pool, 1, 0, out) == 0);
+
+    // Asking for more pages than there are gets every one of them once,
+    // then nothing
+    CHECK(buddy_pool_alloc_bulk(&pool, 1, PAGES + 16, out) == PAGES);
+    memset(owner, 0, sizeof(owner));
+    for (int i = 0; i < PAGES; i++) {
+        int idx = page_index(out[i]);
+        CHECK(idx >= 0 && idx < PAGES && owner[idx] == 0);
+        CHECK(buddy_pool_query_ranks(&pool, out[i]) == 1);
+        owner[idx] = 1;
+    }
+    CHECK(buddy_pool_alloc_bulk(&pool, 1, 1, out + PAGES) == -ENOSPC);
+
+    // Pages 32 to 47 back in reverse order, one of them twice: the
+    // duplicate fails the call, the sixteen merge into one rank-5 block
+    void *batch[17];
+    for (int i = 0; i < 16; i++) {
+        batch[i] = page(47 - i);
+    }
+    batch[16] = page(40);
+    CHECK(buddy_pool_return_bulk(&pool, batch, 17) == -EINVAL);
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    CHECK(info.free_pages == 16 && info.blocks[5] == 1);
+    CHECK(buddy_pool_check(&pool) == OK);
+
+    // The rest, with a page that is already free and NULL mixed in
+    int n = 0;
+    for (int i = 0; i < PAGES; i++) {
+        if (page_index(out[i]) < 32 || page_index(out[i]) >= 48) {
+            out[n++] = out[i];
+        }
+    }
+    out[n++] = page(33);
+    out[n++] = NULL;
+    CHECK(buddy_pool_return_bulk(&pool, out, n) == -EINVAL);
+    check_empty();
+
+    // Rank-3 blocks come out as blocks of that rank; an interior page in
+    // the batch fails the call without keeping its block from being freed
+    CHECK(buddy_pool_alloc_bulk(&pool, 3, 5, out) == 5);
+    for (int i = 0; i < 5; i++) {
+        CHECK(page_index(out[i]) % 4 == 0);
+        CHECK(buddy_pool_query_ranks(&pool, out[i]) == 3);
+    }
+    out[5] = (char *)out[2] + BUDDY_PAGE_SIZE;
+    CHECK(buddy_pool_return_bulk(&pool, out, 6) == -EINVAL);
+    check_empty();
+
+    // The same through the default pool's calls
+    CHECK(init_page_meta(arena, PAGES, meta) == OK);
+    CHECK(alloc_pages_bulk(2, PAGES, out) == PAGES / 2);
+    CHECK(alloc_pages_bulk(2, 1, out + PAGES / 2) == -ENOSPC);
+    for (int i = 0; i < PAGES / 2; i++) {
+        CHECK(query_ranks(out[i]) == 2);
+    }
+    CHECK(return_pages_bulk(out, PAGES / 2) == OK);
+    CHECK(alloc_pages_bulk(1, PAGES, out) == PAGES);
+    CHECK(return_pages_bulk(out, PAGES) == OK);
+}
+
+/*
+ * Statistics
+ */
+
+static void test_stats(int flags) {
+    static void *out[PAGES];
+    struct buddy_stats stats;
+    struct buddy_free_info info;
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags) == OK);
+    CHECK(buddy_pool_get_stats(&pool, &stats) == -EINVAL);
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags | BUDDY_POOL_STATS) == OK);
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    int top = info.largest_free_rank, ntop = info.blocks[top];
+
+    // One page splits the whole chain down from a top block, and merges
+    // it all back when returned
+    void *p = buddy_pool_alloc(&pool, 1);
+    CHECK(!IS_ERR(p));
+    CHECK(buddy_pool_return(&pool, p) == OK);
+    CHECK(buddy_pool_return(&pool, p) == -EINVAL);
+    CHECK(buddy_pool_get_stats(&pool, &stats) == OK);
+    CHECK(stats.alloc[1] == 1 && stats.free[1] == 1);
+    CHECK(stats.splits == (unsigned long)top - 1 && stats.merges == (unsigned long)top - 1);
+    CHECK(stats.invalid_frees == 1);
+    CHECK(stats.avg_merge_chain == top - 1);
+    CHECK(stats.largest_free_rank == top);
+
+    // Bulk calls count every block; splitting every top block into pages
+    // takes one split per page less than there were top blocks, and a
+    // failed allocation counts at its requested rank
+    buddy_pool_reset_stats(&pool);
+    CHECK(buddy_pool_alloc_bulk(&pool, 2, PAGES, out) == PAGES / 2);
+    CHECK(PTR_ERR(buddy_pool_alloc(&pool, 1)) == -ENOSPC);
+    CHECK(buddy_pool_get_stats(&pool, &stats) == OK);
+    CHECK(stats.alloc[2] == PAGES / 2 && stats.alloc[1] == 0);
+    CHECK(stats.enospc[2] == 1 && stats.enospc[1] == 1);
+    CHECK(stats.splits == (unsigned long)(PAGES / 2 - ntop));
+    CHECK(stats.largest_free_rank == 0);
+    CHECK(buddy_pool_return_bulk(&pool, out, PAGES / 2) == OK);
+    CHECK(buddy_pool_get_stats(&pool, &stats) == OK);
+    CHECK(stats.free[2] == PAGES / 2);
+    CHECK(stats.merges == stats.splits);
+    CHECK(stats.largest_free_rank == top);
+
+    buddy_pool_reset_stats(&pool);
+    CHECK(buddy_pool_get_stats(&pool, &stats) == OK);
+    CHECK(stats.alloc[2] == 0 && stats.free[2] == 0 && stats.enospc[1] == 0);
+    CHECK(stats.splits == 0 && stats.merges == 0 && stats.invalid_frees == 0);
+    check_empty();
+}
+
+/*
+ * Fragmentation indices
+ */
+
+static void test_indices(void) {
+    struct buddy_free_info info;
+    int pgcount = PAGES / 4;
+    CHECK(buddy_pool_init_ex(&pool, arena, pgcount, meta, 0) == OK);
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    CHECK(buddy_unusable_index(&info, 0) == -EINVAL);
+    CHECK(buddy_unusable_index(&info, MAXRANK + 1) == -EINVAL);
+    CHECK(buddy_unusable_index(NULL, 1) == -EINVAL);
+    CHECK(buddy_fragmentation_index(&info, 0) == -EINVAL);
+    CHECK(buddy_fragmentation_index(&info, MAXRANK + 1) == -EINVAL);
+    CHECK(buddy_fragmentation_index(NULL, 1) == -EINVAL);
+
+    // All free: every rank up to the largest block is allocatable
+    for (int rank = 1; rank <= info.largest_free_rank; rank++) {
+        CHECK(buddy_unusable_index(&info, rank) == 0);
+        CHECK(buddy_fragmentation_index(&info, rank) == -1000);
+    }
+
+    // Nothing free
+    for (int i = 0; i < pgcount; i++) {
+        CHECK(!IS_ERR(buddy_pool_alloc(&pool, 1)));
+    }
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    CHECK(buddy_unusable_index(&info, 2) == 0);
+    CHECK(buddy_fragmentation_index(&info, 2) == 0);
+
+    // Every other page free: half the memory, none of it usable at rank 2,
+    // 1000 - (1000 + 512 * 1000 / 2) / 512 for fragmentation
+    for (int i = 0; i < pgcount; i += 2) {
+        CHECK(buddy_pool_return(&pool, page(i)) == OK);
+    }
+    CHECK(buddy_pool_query_free(&pool, &info) == OK);
+    CHECK(buddy_unusable_index(&info, 1) == 0);
+    CHECK(buddy_fragmentation_index(&info, 1) == -1000);
+    CHECK(buddy_unusable_index(&info, 2) == 1000);
+    CHECK(buddy_fragmentation_index(&info, 2) == 499);
+}
+
+/*
+ * Exact-size ranges
+ */
+
+static void test_exact(int lazy) {
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, 0) == OK);
+    CHECK(buddy_pool_set_lazy(&pool, lazy) == OK);
+    CHECK(PTR_ERR(buddy_pool_alloc_exact(&pool, 0)) == -EINVAL);
+    CHECK(PTR_ERR(buddy_pool_alloc_exact(&pool, (1 << (MAXRANK - 1)) + 1)) == -EINVAL);
+
+    // Five pages are a rank-3 piece and a rank-1 one, the other three
+    // pages of their rank-4 block go back right away
+    void *p = buddy_pool_alloc_exact(&pool, 5);
+    CHECK(!IS_ERR(p));
+    int idx = page_index(p);
+    CHECK(idx % 8 == 0);
+    CHECK(buddy_pool_query_ranks(&pool, p) == 3);
+    CHECK(buddy_pool_query_ranks(&pool, page(idx + 4)) == 1);
+    struct buddy_free_info info;
+    CHECK(buddy_pool_query_free(&pool, &info) == OK && info.free_pages == PAGES - 5);
+    CHECK(buddy_pool_return(&pool, p) == -EINVAL);
+    CHECK(buddy_pool_return_exact(&pool, p, 4) == -EINVAL);
+    CHECK(buddy_pool_return_exact(&pool, page(idx + 4), 1) == -EINVAL);
+    CHECK(buddy_pool_return_exact(&pool, p, 5) == OK);
+    CHECK(buddy_pool_return_exact(&pool, p, 5) == -EINVAL);
+
+    // Random ranges of up to 40 pages, each page owned by at most one
+    static unsigned char owner[PAGES];
+    static int npages[PAGES];
+    memset(owner, 0, sizeof(owner));
+    unsigned long rng = 0x9e3779b97f4a7c15UL;
+    int used = 0;
+    nlive = 0;
+    for (int op = 0; op < 100000; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive < PAGES / 8 && (nlive == 0 || (r & 1))) {
+            int n = 1 + (int)((r >> 8) % 40);
+            p = buddy_pool_alloc_exact(&pool, n);
+            if (IS_ERR(p)) {
+                CHECK(PTR_ERR(p) == -ENOSPC);
+                continue;
+            }
+            idx = page_index(p);
+            CHECK(idx >= 0 && idx + n <= PAGES);
+            for (int i = 0; i < n; i++) {
+                CHECK(owner[idx + i] == 0);
+                owner[idx + i] = 1;
+            }
+            live[nlive] = p;
+            npages[nlive++] = n;
+            used += n;
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            idx = page_index(live[i]);
+            CHECK(buddy_pool_return_exact(&pool, live[i], npages[i]) == OK);
+            memset(owner + idx, 0, npages[i]);
+            used -= npages[i];
+            nlive--;
+            live[i] = live[nlive];
+            npages[i] = npages[nlive];
+        }
+        if (op % 10000 == 0) {
+            CHECK(lazy > 0 || buddy_pool_check(&pool) == OK);
+            CHECK(buddy_pool_query_free(&pool, &info) == OK &&
+                  info.free_pages == PAGES - used);
+        }
+    }
+    while (nlive > 0) {
+        nlive--;
+        CHECK(buddy_pool_return_exact(&pool, live[nlive], npages[nlive]) == OK);
+    }
+    CHECK(buddy_pool_set_lazy(&pool, 0) == OK);
+    check_empty();
+}
+
+/*
+ * Hardened pools
+ */
+
+static unsigned long invalid_frees(void) {
+    struct buddy_stats stats;
+    CHECK(buddy_pool_get_stats(&pool, &stats) == OK);
+    return stats.invalid_frees;
+}
+
+// Two threads free the same block at once, round after round
+#define RACE_ROUNDS 2000
+
+static pthread_barrier_t race_barrier;
+static void *race_block;
+
+static void *racer(void *arg) {
+    int *won = arg;
+    for (int round = 0; round < RACE_ROUNDS; round++) {
+        pthread_barrier_wait(&race_barrier);
+        if (buddy_pool_return(&pool, race_block) == OK) {
+            (*won)++;
+        }
+        pthread_barrier_wait(&race_barrier);
+    }
+    return NULL;
+}
+
+static void test_hardened(int flags) {
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta,
+                             flags | BUDDY_POOL_HARDENED | BUDDY_POOL_STATS) == OK);
+    void *p = buddy_pool_alloc(&pool, 3);
+    CHECK(!IS_ERR(p));
+
+    // Each rejected free leaves the pool as it was and is counted
+    CHECK(buddy_pool_return(&pool, (char *)p + BUDDY_PAGE_SIZE) == -EINVAL);
+    CHECK(invalid_frees() == 1);
+    CHECK(buddy_pool_return(&pool, (char *)p + 1) == -EINVAL);
+    CHECK(buddy_pool_return(&pool, page(PAGES)) == -EINVAL);
+    CHECK(buddy_pool_return(&pool, arena - BUDDY_PAGE_SIZE) == -EINVAL);
+    CHECK(buddy_pool_return(&pool, NULL) == -EINVAL);
+    CHECK(invalid_frees() == 5);
+    CHECK(buddy_pool_query_ranks(&pool, p) == 3);
+    CHECK(buddy_pool_check(&pool) == OK);
+    CHECK(buddy_pool_return(&pool, p) == OK);
+    CHECK(buddy_pool_return(&pool, p) == -EINVAL);
+    CHECK(invalid_frees() == 6);
+
+    // Through a per-thread cache, and from the cache to the pool
+    buddy_pcp_t pcp;
+    CHECK(buddy_pcp_init(&pcp, &pool, 0, 16) == OK);
+    p = buddy_pool_alloc(&pool, 1);
+    CHECK(!IS_ERR(p));
+    CHECK(buddy_pcp_return(&pcp, p) == OK);
+    CHECK(buddy_pcp_return(&pcp, p) == -EINVAL);
+    CHECK(buddy_pool_return(&pool, p) == -EINVAL);
+    CHECK(invalid_frees() == 8);
+    buddy_pcp_drain(&pcp);
+    check_empty();
+
+    // One free of each racing pair wins and the loser is counted
+    if (flags & BUDDY_POOL_THREADSAFE) {
+        pthread_t thread;
+        int won[2] = {0, 0};
+        buddy_pool_reset_stats(&pool);
+        CHECK(pthread_barrier_init(&race_barrier, NULL, 2) == 0);
+        CHECK(pthread_create(&thread, NULL, racer, &won[1]) == 0);
+        for (int round = 0; round < RACE_ROUNDS; round++) {
+            race_block = buddy_pool_alloc(&pool, 1 + round % 3);
+            CHECK(!IS_ERR(race_block));
+            pthread_barrier_wait(&race_barrier);
+            if (buddy_pool_return(&pool, race_block) == OK) {
+                won[0]++;
+            }
+            pthread_barrier_wait(&race_barrier);
+        }
+        CHECK(pthread_join(thread, NULL) == 0);
+        pthread_barrier_destroy(&race_barrier);
+        CHECK(won[0] + won[1] == RACE_ROUNDS);
+        CHECK(invalid_frees() == RACE_ROUNDS);
+        check_empty();
+    }
+}
+
+/*
+ * Constrained placement
+ */
+
+// A constraint as the random checks draw it, for find_qualifying() to
+// look for a free block that meets it
+struct constraint {
+    int rank;
+    unsigned long align;
+    unsigned long lo;
+    unsigned long hi;
+};
+
+static int meets(const struct constraint *c, unsigned long addr) {
+    unsigned long size = (unsigned long)BUDDY_PAGE_SIZE << (c->rank - 1);
+    return addr % c->align == 0 && addr >= c->lo && addr + size <= c->hi;
+}
+
+static int find_qualifying(void *addr, int rank, int state, void *arg) {
+    const struct constraint *c = arg;
+    unsigned long start = (unsigned long)addr;
+    unsigned long end = start + ((unsigned long)BUDDY_PAGE_SIZE << (rank - 1));
+    unsigned long size = (unsigned long)BUDDY_PAGE_SIZE << (c->rank - 1);
+    if (state & BUDDY_BLOCK_ALLOCATED) {
+        return 0;
+    }
+    for (unsigned long a = start; a + size <= end; a += size) {
+        if (meets(c, a)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *alloc_within(int rank, int align_rank, int lo, int hi) {
+    return buddy_pool_alloc_constrained(&pool, rank, align_rank, (unsigned long)page(lo),
+                                        (unsigned long)page(hi));
+}
+
+static void test_constrained(int flags) {
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, 0) == OK);
+    CHECK(PTR_ERR(alloc_within(1, 0, 0, PAGES)) == -EINVAL);
+
+    // Only pages 1000 to 1039 free: a rank-4 block at 1000 and rank-5
+    // ones at 1008 and 1024
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags) == OK);
+    for (int i = 0; i < PAGES; i++) {
+        CHECK(!IS_ERR(buddy_pool_alloc(&pool, 1)));
+    }
+    for (int i = 1000; i < 1040; i++) {
+        CHECK(buddy_pool_return(&pool, page(i)) == OK);
+    }
+    CHECK(PTR_ERR(alloc_within(1, 0, 10, 10)) == -EINVAL);
+    CHECK(PTR_ERR(alloc_within(1, MAXRANK + 1, 0, PAGES)) == -EINVAL);
+    CHECK(PTR_ERR(alloc_within(1, 0, 0, 1000)) == -ENOSPC);
+    CHECK(PTR_ERR(alloc_within(6, 0, 1000, 1040)) == -ENOSPC);
+    CHECK(alloc_within(2, 0, 1001, 1040) == page(1002));
+    CHECK(alloc_within(1, 5, 1001, 1040) == page(1008));
+    CHECK(alloc_within(3, 0, 1036, 1040) == page(1036));
+    CHECK(buddy_pool_query_ranks(&pool, page(1036)) == 3);
+    CHECK(buddy_pool_check(&pool) == OK);
+    for (int i = 0; i < PAGES; i++) {
+        if (i < 1000 || i >= 1040 || i == 1002 || i == 1008 || i == 1036) {
+            CHECK(buddy_pool_return(&pool, page(i)) == OK);
+        }
+    }
+    check_empty();
+
+    // Random constraints among other allocations
+    unsigned long rng = 0x2545f4914f6cdd1dUL;
+    nlive = 0;
+    for (int op = 0; op < 20000; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive < PAGES / 2 && (nlive == 0 || r % 3 != 0)) {
+            struct constraint c;
+            c.rank = 1 + (int)((r >> 4) % 4);
+            int align_rank = (int)((r >> 8) % 8);
+            c.align = 1;
+            if (align_rank > 0) {
+                c.align = (unsigned long)BUDDY_PAGE_SIZE << (align_rank - 1);
+            }
+            int lo = (int)((r >> 16) % PAGES);
+            c.lo = (unsigned long)page(lo) - (r & 0x80 ? 100 : 0);
+            c.hi = (unsigned long)page(lo + 1 + (int)((r >> 32) % 600));
+            void *p = r & 0x40 ? buddy_pool_alloc(&pool, c.rank)
+                               : buddy_pool_alloc_constrained(&pool, c.rank, align_rank,
+                                                              c.lo, c.hi);
+            if (IS_ERR(p)) {
+                CHECK(PTR_ERR(p) == -ENOSPC);
+                CHECK((r & 0x40) || buddy_pool_walk(&pool, find_qualifying, &c) == 0);
+                continue;
+            }
+            CHECK((r & 0x40) || meets(&c, (unsigned long)p));
+            CHECK(buddy_pool_query_ranks(&pool, p) == c.rank);
+            live[nlive++] = p;
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            CHECK(buddy_pool_return(&pool, live[i]) == OK);
+            live[i] = live[--nlive];
+        }
+        if (op % 1000 == 0) {
+            CHECK(buddy_pool_check(&pool) == OK);
+        }
+    }
+    while (nlive > 0) {
+        CHECK(buddy_pool_return(&pool, live[--nlive]) == OK);
+    }
+    check_empty();
+}
+
+/*
+ * Compaction
+ */
+
+// The mover knows the live blocks, each stamped with its index in live[];
+// it refuses to move `pinned`
+static void *pinned;
+
+static int mover(void *from, void *to, int rank, void *arg) {
+    (void)arg;
+    if (from == pinned) {
+        return 1;
+    }
+    for (int i = 0; i < nlive; i++) {
+        if (live[i] == from) {
+            memcpy(to, from, (size_t)BUDDY_PAGE_SIZE << (rank - 1));
+            live[i] = to;
+            return 0;
+        }
+    }
+    printf("compact: asked to move unknown block %d\n", page_index(from));
+    exit(-1);
+}
+
+static void test_compact(int flags) {
+    // Sixteen live pages in every 128-page region. The highest region ties
+    // for the fewest and comes first, but its lowest block will not move;
+    // the one below holds a block cached by a pcp.
+    int size = 128, target_rank = 8;
+    buddy_pcp_t pcp;
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags) == OK);
+    CHECK(buddy_pcp_init(&pcp, &pool, 0, 16) == OK);
+    for (int i = 0; i < PAGES; i++) {
+        CHECK(!IS_ERR(buddy_pool_alloc(&pool, 1)));
+    }
+    nlive = 0;
+    for (int i = 0; i < PAGES; i++) {
+        if (i % 8 != 0) {
+            CHECK(buddy_pool_return(&pool, page(i)) == OK);
+        } else if (i == PAGES - 2 * size + 8) {
+            CHECK(buddy_pcp_return(&pcp, page(i)) == OK);
+        } else {
+            *(int *)page(i) = nlive;
+            live[nlive++] = page(i);
+        }
+    }
+    pinned = page(PAGES - size);
+
+    // Later calls get past the pinned block and evacuate the third region
+    // from the top instead
+    int moved = 0;
+    for (int call = 0; call < 64; call++) {
+        int ret = buddy_pool_compact(&pool, target_rank, 4, mover, NULL);
+        CHECK(ret >= 0);
+        if (ret == 0 && buddy_pool_query_page_counts(&pool, target_rank) > 0) {
+            break;
+        }
+        moved += ret;
+    }
+    CHECK(moved == size / 8);
+    CHECK(buddy_pool_query_page_counts(&pool, target_rank) == 1);
+    CHECK(buddy_pool_query_ranks(&pool, page(PAGES - 3 * size)) == target_rank);
+    for (int i = 0; i < nlive; i++) {
+        CHECK(*(int *)live[i] == i);
+        CHECK(page_index(live[i]) < PAGES - 3 * size ||
+              page_index(live[i]) >= PAGES - 2 * size);
+    }
+    CHECK(buddy_pcp_alloc(&pcp, 1) == page(PAGES - 2 * size + 8));
+    CHECK(buddy_pool_check(&pool) == OK);
+
+    CHECK(buddy_pool_return(&pool, page(PAGES - 2 * size + 8)) == OK);
+    for (int i = 0; i < nlive; i++) {
+        CHECK(buddy_pool_return(&pool, live[i]) == OK);
+    }
+    check_empty();
+}
+
+/*
+ * Snapshots
+ */
+
+// Free-space summary, padding cleared so that two compare as a whole
+static void query_free(struct buddy_free_info *info) {
+    memset(info, 0, sizeof(*info));
+    CHECK(buddy_pool_query_free(&pool, info) == OK);
+}
+
+// Every live block must still be allocated at its rank, and free and
+// allocate again as that block
+static void check_live(void) {
+    CHECK(buddy_pool_check(&pool) == OK);
+    for (int i = 0; i < nlive; i++) {
+        CHECK(buddy_pool_query_ranks(&pool, live[i]) == live_rank[i]);
+        CHECK(buddy_pool_return(&pool, live[i]) == OK);
+        unsigned long addr = (unsigned long)live[i];
+        unsigned long size = (unsigned long)BUDDY_PAGE_SIZE << (live_rank[i] - 1);
+        CHECK(buddy_pool_alloc_constrained(&pool, live_rank[i], 0, addr, addr + size) ==
+              live[i]);
+    }
+}
+
+static void test_snapshot(int flags) {
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, flags) == OK);
+    unsigned long rng = 0xd1b54a32d192ed03UL;
+    nlive = 0;
+    for (int op = 0; op < 20000; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive < PAGES / 4 && (r & 1)) {
+            int rank = 1 + (int)((r >> 8) % 4);
+            int cls = (int)((r >> 16) % BUDDY_CLASSES);
+            void *p = buddy_pool_alloc_class(&pool, rank, cls);
+            if (!IS_ERR(p)) {
+                live[nlive] = p;
+                live_rank[nlive++] = rank;
+            }
+        } else if (nlive > 0) {
+            int i = (int)((r >> 8) % nlive);
+            CHECK(buddy_pool_return(&pool, live[i]) == OK);
+            nlive--;
+            live[i] = live[nlive];
+            live_rank[i] = live_rank[nlive];
+        }
+    }
+    unsigned long len = buddy_pool_snapshot_size(&pool);
+    char *snap = malloc(len);
+    CHECK(snap != NULL);
+    CHECK(buddy_pool_snapshot(&pool, snap, len - 1) == -ENOSPC);
+    CHECK(buddy_pool_snapshot(&pool, snap, len) == OK);
+    struct buddy_free_info before, after;
+    query_free(&before);
+
+    // Into fresh metadata, as a new process would, while the old copy
+    // lingers
+    void *copy = malloc(buddy_meta_size_ex(PAGES, flags));
+    CHECK(copy != NULL);
+    memset(&pool, 0xa5, sizeof(pool));
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, copy) == OK);
+    query_free(&after);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+    check_live();
+
+    // In place, from a snapshot of the arena as it is now: the snapshot
+    // becomes the metadata, and a second snapshot into it after some
+    // frees restores the same way
+    CHECK(buddy_pool_snapshot(&pool, snap, len) == OK);
+    memset(&pool, 0xa5, sizeof(pool));
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, NULL) == OK);
+    check_live();
+    for (int n = nlive / 2; nlive > n;) {
+        CHECK(buddy_pool_return(&pool, live[--nlive]) == OK);
+    }
+    CHECK(buddy_pool_snapshot(&pool, snap, len) == OK);
+    query_free(&before);
+    memset(&pool, 0xa5, sizeof(pool));
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, NULL) == OK);
+    query_free(&after);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+    check_live();
+    while (nlive > 0) {
+        CHECK(buddy_pool_return(&pool, live[--nlive]) == OK);
+    }
+    check_empty();
+
+    // Headers that do not match are refused
+    CHECK(buddy_pool_snapshot(&pool, snap, len) == OK);
+    CHECK(buddy_pool_restore(&pool, arena, snap, len - 1, copy) == -EINVAL);
+    ((struct buddy_snapshot *)snap)->version++;
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, copy) == -EINVAL);
+    ((struct buddy_snapshot *)snap)->version--;
+
+    // A bad list head, in the last list the restore looks at, is refused
+    // without touching the pool, which by now differs from the snapshot
+    for (int rank = 1; rank <= 4; rank++) {
+        live[nlive] = buddy_pool_alloc(&pool, rank);
+        CHECK(!IS_ERR(live[nlive]));
+        live_rank[nlive++] = rank;
+    }
+    query_free(&before);
+    struct buddy_snapshot *header = (struct buddy_snapshot *)snap;
+    int head = header->class_area[BUDDY_CLASSES - 1][MAXRANK - 1].head;
+    header->class_area[BUDDY_CLASSES - 1][MAXRANK - 1].head = PAGES;
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, copy) == -EINVAL);
+    header->class_area[BUDDY_CLASSES - 1][MAXRANK - 1].head = head;
+    header->area[MAXRANK].head = PAGES;
+    CHECK(buddy_pool_restore(&pool, arena, snap, len, NULL) == -EINVAL);
+    CHECK(buddy_pool_check(&pool) == OK);
+    query_free(&after);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+    check_live();
+    while (nlive > 0) {
+        CHECK(buddy_pool_return(&pool, live[--nlive]) == OK);
+    }
+    check_empty();
+    free(copy);
+    free(snap);
+}
+
+/*
+ * Shared pools
+ */
+
+// Random allocations and frees on a shared pool, each block stamped with
+// seed to catch one handed to two processes at once
+static void churn(buddy_pool_t *shared, unsigned long seed) {
+    unsigned long rng = seed;
+    nlive = 0;
+    for (int op = 0; op < 100000; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive < PAGES / 16 && (nlive == 0 || (r & 1))) {
+            void *p = buddy_pool_alloc(shared, 1 + (int)((r >> 8) % 3));
+            if (IS_ERR(p)) {
+                CHECK(PTR_ERR(p) == -ENOSPC);
+                continue;
+            }
+            *(unsigned long *)p = seed;
+            live[nlive++] = p;
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            CHECK(*(unsigned long *)live[i] == seed);
+            CHECK(buddy_pool_return(shared, live[i]) == OK);
+            live[i] = live[--nlive];
+        }
+    }
+    while (nlive > 0) {
+        void *p = live[--nlive];
+        CHECK(*(unsigned long *)p == seed);
+        CHECK(buddy_pool_return(shared, p) == OK);
+    }
+}
+
+static void test_shared(int flags) {
+    char name[64];
+    snprintf(name, sizeof(name), "/buddy_test_%d", (int)getpid());
+    buddy_os_shared_unlink(name);
+    buddy_pool_t *shared = buddy_os_shared_open(name, PAGES / 4, flags);
+    CHECK(!IS_ERR(shared));
+    struct buddy_free_info before, after;
+    CHECK(buddy_pool_query_free(shared, &before) == OK);
+
+    // The first child passes a message block to the parent as an offset
+    // into the segment
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    for (int child = 0; child < 3; child++) {
+        pid_t pid = fork();
+        CHECK(pid >= 0);
+        if (pid > 0) {
+            continue;
+        }
+        // A hole first, so that the segment maps elsewhere
+        CHECK(mmap(NULL, 1 << 20, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) !=
+              MAP_FAILED);
+        buddy_pool_t *attached = buddy_os_shared_open(name, 0, 0);
+        CHECK(!IS_ERR(attached) && attached != shared);
+        churn(attached, 0x1111UL * (child + 1));
+        if (child == 0) {
+            // The others may still hold every page for a while
+            char *msg;
+            while (IS_ERR(msg = buddy_pool_alloc(attached, 1))) {
+                CHECK(PTR_ERR(msg) == -ENOSPC);
+                sched_yield();
+            }
+            strcpy(msg, "hello");
+            long offset = msg - (char *)attached;
+            CHECK(write(fds[1], &offset, sizeof(offset)) == sizeof(offset));
+        }
+        buddy_os_shared_close(attached);
+        exit(0);
+    }
+    // Only the children write, so a child that fails ends the read
+    close(fds[1]);
+    churn(shared, 0x7777);
+    long offset;
+    CHECK(read(fds[0], &offset, sizeof(offset)) == sizeof(offset));
+    CHECK(strcmp((char *)shared + offset, "hello") == 0);
+    CHECK(buddy_pool_return(shared, (char *)shared + offset) == OK);
+    for (int child = 0; child < 3; child++) {
+        int status;
+        CHECK(wait(&status) > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    close(fds[0]);
+
+    CHECK(buddy_pool_drain(shared) >= 0);
+    CHECK(buddy_pool_check(shared) == OK);
+    CHECK(buddy_pool_query_free(shared, &after) == OK);
+    CHECK(after.free_pages == before.free_pages);
+    CHECK(after.largest_free_rank == before.largest_free_rank);
+    buddy_os_shared_close(shared);
+    CHECK(buddy_os_shared_unlink(name) == OK);
+}
+
+#ifdef BUDDY_TRACE
+/*
+ * Trace smoke run
+ */
+
+static void trace_run(void) {
+    static void *out[PAGES];
+    static int npages[PAGES];
+    long count[BUDDY_TRACE_FREE_EXACT + 1] = {0};
+    // Already recording into $BUDDY_TRACE_FILE since startup
+    CHECK(buddy_trace_start("/dev/null") == -EINVAL);
+
+    CHECK(buddy_pool_init_ex(&pool, arena, PAGES, meta, 0) == OK);
+    count[BUDDY_TRACE_INIT]++;
+    unsigned long rng = 0x2545f4914f6cdd1dUL;
+    nlive = 0;
+    for (int op = 0; op < 20000; op++) {
+        unsigned long r = xorshift(&rng);
+        if (nlive == 0 || (nlive < PAGES / 16 && (r & 1))) {
+            void *p;
+            if (r & 2) {
+                npages[nlive] = 1 + (int)((r >> 8) % 40);
+                p = buddy_pool_alloc_exact(&pool, npages[nlive]);
+            } else {
+                npages[nlive] = 0;
+                p = buddy_pool_alloc(&pool, 1 + (int)((r >> 8) % 4));
+            }
+            if (IS_ERR(p)) {
+                CHECK(PTR_ERR(p) == -ENOSPC);
+                count[BUDDY_TRACE_ENOSPC]++;
+                continue;
+            }
+            count[npages[nlive] ? BUDDY_TRACE_ALLOC_EXACT : BUDDY_TRACE_ALLOC]++;
+            live[nlive++] = p;
+        } else {
+            int i = (int)((r >> 8) % nlive);
+            if (npages[i]) {
+                CHECK(buddy_pool_return_exact(&pool, live[i], npages[i]) == OK);
+                count[BUDDY_TRACE_FREE_EXACT]++;
+            } else {
+                CHECK(buddy_pool_return(&pool, live[i]) == OK);
+                count[BUDDY_TRACE_FREE]++;
+            }
+            nlive--;
+            live[i] = live[nlive];
+            npages[i] = npages[nlive];
+        }
+    }
+
+    // Every page that is left in one bulk call, which runs out, then
+    // nothing at all
+    int got = buddy_pool_alloc_bulk(&pool, 1, PAGES, out);
+    CHECK(got > 0 && got < PAGES);
+    count[BUDDY_TRACE_ALLOC] += got;
+    count[BUDDY_TRACE_ENOSPC]++;
+    CHECK(PTR_ERR(buddy_pool_alloc(&pool, 1)) == -ENOSPC);
+    CHECK(PTR_ERR(buddy_pool_alloc_exact(&pool, 1)) == -ENOSPC);
+    count[BUDDY_TRACE_ENOSPC] += 2;
+    CHECK(buddy_pool_return_bulk(&pool, out, got) == OK);
+    count[BUDDY_TRACE_FREE] += got;
+    while (nlive > 0) {
+        nlive--;
+        if (npages[nlive]) {
+            CHECK(buddy_pool_return_exact(&pool, live[nlive], npages[nlive]) == OK);
+            count[BUDDY_TRACE_FREE_EXACT]++;
+        } else {
+            CHECK(buddy_pool_return(&pool, live[nlive]) == OK);
+            count[BUDDY_TRACE_FREE]++;
+        }
+    }
+    check_empty();
+    printf("%ld init, %ld alloc, %ld free, %ld enospc, %ld alloc_exact, "
+           "%ld free_exact\n",
+           count[BUDDY_TRACE_INIT], count[BUDDY_TRACE_ALLOC], count[BUDDY_TRACE_FREE],
+           count[BUDDY_TRACE_ENOSPC], count[BUDDY_TRACE_ALLOC_EXACT],
+           count[BUDDY_TRACE_FREE_EXACT]);
+}
+#endif
+
+int main(int argc, char **argv) {
+    // Aligned to the whole arena, so that page alignment goes by index
+    arena = aligned_alloc((long)PAGES * BUDDY_PAGE_SIZE, (long)PAGES * BUDDY_PAGE_SIZE);
+    meta = malloc(buddy_meta_size_ex(PAGES, BUDDY_POOL_ADDRESS_ORDERED |
+                                                BUDDY_POOL_OFFPAGE |
+                                                BUDDY_POOL_PAGEBLOCK(2)));
+    if (arena == NULL || meta == NULL) {
+        printf("out of memory\n");
+        return -1;
+    }
+#ifdef BUDDY_TRACE
+    if (argc == 2 && strcmp(argv[1], "trace") == 0 && getenv("BUDDY_TRACE_FILE") != NULL) {
+        trace_run();
+        return 0;
+    }
+#endif
+    if (argc > 1) {
+        printf("usage: %s [trace]\n", argv[0]);
+        return -1;
+    }
+
+    test_bulk(0);
+    test_bulk(BUDDY_POOL_THREADSAFE | BUDDY_POOL_ADDRESS_ORDERED);
+    test_bulk(BUDDY_POOL_HARDENED);
+    test_stats(0);
+    test_stats(BUDDY_POOL_THREADSAFE);
+    test_indices();
+    test_exact(0);
+    test_exact(8);
+    test_hardened(0);
+    test_hardened(BUDDY_POOL_THREADSAFE);
+    test_constrained(BUDDY_POOL_ADDRESS_INDEX);
+    test_constrained(BUDDY_POOL_ADDRESS_ORDERED);
+    test_constrained(BUDDY_POOL_ADDRESS_INDEX | BUDDY_POOL_PAGEBLOCK(4));
+    test_compact(BUDDY_POOL_ADDRESS_INDEX);
+    test_compact(BUDDY_POOL_ADDRESS_INDEX | BUDDY_POOL_HARDENED);
+    test_snapshot(BUDDY_POOL_ADDRESS_INDEX);
+    test_snapshot(BUDDY_POOL_ADDRESS_INDEX | BUDDY_POOL_OFFPAGE);
+    test_snapshot(BUDDY_POOL_ADDRESS_INDEX | BUDDY_POOL_PAGEBLOCK(4));
+    test_snapshot(BUDDY_POOL_ADDRESS_INDEX | BUDDY_POOL_THREADSAFE | BUDDY_POOL_DEFERRED);
+    test_shared(0);
+    test_shared(BUDDY_POOL_OFFPAGE | BUDDY_POOL_ADDRESS_ORDERED);
+    test_shared(BUDDY_POOL_DEFERRED);
+    printf("All tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <endian.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+/*
+ * Trace recorder. Events are buffered under one mutex and written in
+ * chunks; tracing is a diagnostic build, so simplicity wins over
+ * recording overhead here. Fields are converted to little-endian as they
+ * are recorded.
+ */
+
+#define TRACE_BUFFER 4096
+#define TRACE_POOLS 255
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static struct buddy_trace_record buffer[TRACE_BUFFER];
+static int buffered;
+static long start_ns;
+static buddy_pool_t *pools[TRACE_POOLS];
+static int npools;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void flush_buffer(void) {
+    if (buffered > 0) {
+        fwrite(buffer, sizeof(buffer[0]), buffered, trace_file);
+        buffered = 0;
+    }
+}
+
+int buddy_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return -EINVAL;
+    }
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return -EINVAL;
+    }
+
+    struct buddy_trace_header header;
+    memcpy(header.magic, BUDDY_TRACE_MAGIC, sizeof(header.magic));
+    header.version = htole32(BUDDY_TRACE_VERSION);
+    header.record_size = htole32(sizeof(struct buddy_trace_record));
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    buffered = 0;
+    npools = 0;
+    start_ns = now_ns();
+    pthread_mutex_unlock(&trace_lock);
+    return OK;
+}
+
+int buddy_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return -EINVAL;
+    }
+    flush_buffer();
+    fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+    return OK;
+}
+
+void buddy_trace_event(buddy_pool_t *pool, int op, int rank, int page_idx, int pages) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+
+    int id = 0;
+    while (id < npools && pools[id] != pool) {
+        id++;
+    }
+    if (id == npools) {
+        if (npools == TRACE_POOLS) {
+            pthread_mutex_unlock(&trace_lock);
+            return;  // Too many pools to tell apart; drop the event
+        }
+        pools[npools++] = pool;
+    }
+
+    struct buddy_trace_record *rec = &buffer[buffered++];
+    rec->ts = htole64((uint64_t)(now_ns() - start_ns));
+    rec->id = htole32((uint32_t)page_idx);
+    rec->pages = htole32((uint32_t)pages);
+    rec->op = op;
+    rec->rank = rank;
+    rec->pool = id;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+    if (buffered == TRACE_BUFFER) {
+        flush_buffer();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_at_exit(void) {
+    buddy_trace_stop();
+}
+
+__attribute__((constructor)) static void trace_from_env(void) {
+    const char *path = getenv("BUDDY_TRACE_FILE");
+    if (path != NULL && buddy_trace_start(path) == OK) {
+        atexit(trace_at_exit);
+    }
+}
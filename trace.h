@@ -0,0 +1,68 @@
+#ifndef BUDDY_TRACE_H
+#define BUDDY_TRACE_H
+
+#include <stdint.h>
+
+#include "buddy.h"
+
+/*
+ * Allocator trace format.
+ *
+ * A trace file is one buddy_trace_header followed by fixed-size records
+ * in event order. Blocks are identified by their head page index, which
+ * is unique while the block is live, so a replay can map ids to
+ * pointers with a table of pgcount entries. Pools are numbered in the
+ * order they are first seen. All fields are little-endian.
+ *
+ *   INIT    id = pgcount of a (re)initialised pool
+ *   ALLOC   rank = requested rank, id = page index of the block
+ *   FREE    id = page index of the returned block
+ *   ENOSPC  rank = requested rank, no block was allocated; for an
+ *           exact-size range, rank = 0 and pages = its size
+ *   ALLOC_EXACT, FREE_EXACT
+ *           an exact-size range from buddy_pool_alloc_exact() and its
+ *           buddy_pool_return_exact(): id = page index of its first
+ *           piece, pages = its size
+ *
+ * pages is 0 for every other record.
+ *
+ * Programs built with -DBUDDY_TRACE and linked with trace.c record into
+ * the file named by $BUDDY_TRACE_FILE from startup until exit, or
+ * between explicit buddy_trace_start()/buddy_trace_stop() calls.
+ */
+
+#define BUDDY_TRACE_MAGIC "BDYTRACE"
+#define BUDDY_TRACE_VERSION 2
+
+enum {
+    BUDDY_TRACE_INIT,
+    BUDDY_TRACE_ALLOC,
+    BUDDY_TRACE_FREE,
+    BUDDY_TRACE_ENOSPC,
+    BUDDY_TRACE_ALLOC_EXACT,
+    BUDDY_TRACE_FREE_EXACT,
+};
+
+struct buddy_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct buddy_trace_record {
+    uint64_t ts;      /* ns since the trace started */
+    uint32_t id;
+    uint32_t pages;
+    uint8_t op;
+    uint8_t rank;
+    uint8_t pool;
+    uint8_t reserved[5];
+};
+
+int buddy_trace_start(const char *path);
+int buddy_trace_stop(void);
+
+/* Called by buddy.c for every traced event */
+void buddy_trace_event(buddy_pool_t *pool, int op, int rank, int page_idx, int pages);
+
+#endif